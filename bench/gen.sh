@@ -0,0 +1,84 @@
+#!/bin/bash
+# Generates scaled-up benchmark programs and their expected output.
+# usage: gen.sh <output dir> [scale]
+
+out=${1:?usage: gen.sh <output dir> [scale]}
+scale=${2:-1}
+mkdir -p "$out"
+
+# many short calls (recursion only 25 deep)
+n=$((24 + scale))
+cat > "$out/fib_rek" <<R
+int fibRek <- function(int n){
+    if(n < 3){
+        return(1)
+    }
+    else {
+        return(fibRek(n - 1) + fibRek(n - 2))
+    }
+}
+
+int main <- function() {
+    print(fibRek($n))
+}
+R
+awk -v n=$n 'BEGIN { a = 1; b = 1; for(i = 3; i <= n; i++) { t = b; b = a + b; a = t } print b }' > "$out/fib_rek.expected"
+
+# deep recursion: a linear, not tail recursive, sum a million calls deep
+n=$((1000000 * scale))
+cat > "$out/rec_deep" <<R
+long sumDown <- function(long n) {
+    if(n == 0) {
+        return(0)
+    }
+    return(n + sumDown(n - 1))
+}
+
+int main <- function() {
+    print(sumDown($n))
+}
+R
+awk -v n=$n 'BEGIN { printf("%.0f\n", n * (n + 1) / 2) }' > "$out/rec_deep.expected"
+
+# long for loop with a double accumulator
+n=$((10000000 * scale))
+cat > "$out/for_long" <<R
+int main <- function() {
+    s = 0.0
+    for(i in 0:$n) {
+        s = s + i * 0.5
+    }
+    print(s)
+}
+R
+awk -v n=$n 'BEGIN { printf("%f\n", n * (n + 1) / 4) }' > "$out/for_long.expected"
+
+# big array literal summed in a loop
+n=$((2000 * scale))
+{
+    echo "int main <- function() {"
+    printf "    a = array(0"
+    for((i = 1; i < n; i++)); do printf ", %d" $i; done
+    echo ")"
+    echo "    b = 0.0"
+    echo "    for(i in 0:$((n - 1))) {"
+    echo "        b = b + a[i]"
+    echo "    }"
+    echo "    print(b)"
+    echo "}"
+} > "$out/array_big"
+awk -v n=$n 'BEGIN { printf("%f\n", n * (n - 1) / 2) }' > "$out/array_big.expected"
+
+# long seq range summed in a loop
+n=$((1000000 * scale))
+cat > "$out/seq_long" <<R
+int main <- function() {
+    a = seq(1, $n, 1)
+    b = 0.0
+    for(i in 0:$((n - 1))) {
+        b = b + a[i]
+    }
+    print(b)
+}
+R
+awk -v n=$n 'BEGIN { printf("%f\n", n * (n + 1) / 2) }' > "$out/seq_long.expected"
@@ -0,0 +1,108 @@
+#!/bin/bash
+# Compiles every benchmark program at -O0..-O3 and at -O0 and -O2 with
+# --checked, runs it, runs it with --interpret at --hot-threshold 1, 1000000
+# and 0 and writes one CSV row per program and level:
+#   program,opt,compile_ms,run_ms,status
+# opt is O0..O3, O0-checked, O2-checked or interpret-t<threshold>, whose
+# run_ms includes compiling. status is ok, wrong (output differs from
+# <program>.expected, or from the -O0 output when there is no expected
+# file), compile-error or crash. tests/trap* must instead trap with
+# --checked, a normal exit is wrong.
+# usage: run.sh <compiler> <output csv> [scale]
+
+compiler=$(realpath "${1:?usage: run.sh <compiler> <output csv> [scale]}")
+csv=${2:?usage: run.sh <compiler> <output csv> [scale]}
+scale=${3:-1}
+root=$(dirname "$(realpath "$0")")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+"$root/gen.sh" "$work/gen" "$scale"
+
+ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Compiles $prog with the given flags, runs it and writes its row; the
+# output must be $expected
+compile_and_run() {
+    label=$1
+    shift
+    exe="$work/$name.$label"
+    start=$(ms)
+    if ! "$compiler" "$@" -o "$exe" < "$prog" 2> "$work/$name.err"; then
+        echo "$name,$label,$(( $(ms) - start )),,compile-error" >> "$csv"
+        return
+    fi
+    compile=$(( $(ms) - start ))
+
+    start=$(ms)
+    if ! "$exe" > "$exe.out" 2>&1; then
+        echo "$name,$label,$compile,$(( $(ms) - start )),crash" >> "$csv"
+        return
+    fi
+    run=$(( $(ms) - start ))
+
+    status=ok
+    if ! cmp -s "$expected" "$exe.out"; then
+        status=wrong
+    fi
+    echo "$name,$label,$compile,$run,$status" >> "$csv"
+}
+
+echo "program,opt,compile_ms,run_ms,status" > "$csv"
+for prog in "$root"/../tests/test* "$work"/gen/*; do
+    case "$prog" in *.expected) continue;; esac
+    name=$(basename "$prog")
+    expected="$prog.expected"
+    if [ ! -f "$expected" ]; then
+        expected="$work/$name.O0.out"
+    fi
+    for opt in 0 1 2 3; do
+        compile_and_run O$opt -O$opt
+    done
+    compile_and_run O0-checked -O0 --checked
+    compile_and_run O2-checked -O2 --checked
+
+    # --interpret with every function compiled on its second call, with
+    # only looping functions compiled and with nothing compiled
+    for threshold in 1 1000000 0; do
+        start=$(ms)
+        if ! "$compiler" --interpret --hot-threshold $threshold < "$prog" > "$work/$name.t$threshold.out" 2>&1; then
+            echo "$name,interpret-t$threshold,,$(( $(ms) - start )),crash" >> "$csv"
+            continue
+        fi
+        run=$(( $(ms) - start ))
+        status=ok
+        if ! cmp -s "$expected" "$work/$name.t$threshold.out"; then
+            status=wrong
+        fi
+        echo "$name,interpret-t$threshold,,$run,$status" >> "$csv"
+    done
+done
+
+# tests/trap* index out of range: with --checked they must die on the trap
+# (a signal), anything else is wrong
+for prog in "$root"/../tests/trap*; do
+    name=$(basename "$prog")
+    for opt in 0 2; do
+        exe="$work/$name.O$opt-checked"
+        start=$(ms)
+        if ! "$compiler" -O$opt --checked -o "$exe" < "$prog" 2> "$work/$name.err"; then
+            echo "$name,O$opt-checked,$(( $(ms) - start )),,compile-error" >> "$csv"
+            continue
+        fi
+        compile=$(( $(ms) - start ))
+
+        start=$(ms)
+        "$exe" > /dev/null 2>&1
+        code=$?
+        run=$(( $(ms) - start ))
+        status=ok
+        if [ $code -le 128 ]; then
+            status=wrong
+        fi
+        echo "$name,O$opt-checked,$compile,$run,$status" >> "$csv"
+    done
+done
+cat "$csv"
@@ -1,503 +1,1021 @@
 #include "ast.hpp"
+#include "backend.hpp"
+#include "stats.hpp"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/ThreadPool.h"
 #include <iostream>
 
-LLVMContext TheContext;
-Module* TheModule;
-IRBuilder<> Builder(TheContext);
-map<Function*, map<string,  AllocaInst*>> NamedValues;
-llvm::legacy::FunctionPassManager *TheFPM;
-extern Function *Printf;
-extern Value* StringInt;
-extern Value* StringDouble;
+/* Codegen state is per thread: a Compiler owns the state of the thread it
+   runs on and with -j every shard of the program is generated in its own
+   context and module */
+thread_local unique_ptr<LLVMContext> TheContext;
+thread_local Module* TheModule;
+thread_local unique_ptr<IRBuilder<>> Builder;
+thread_local ScopeTable<AllocaInst*> NamedValues;
+thread_local llvm::legacy::FunctionPassManager *TheFPM;
+thread_local TargetMachine *TheTargetMachine;
+thread_local Function *Main;
+thread_local Function *Printf;
+thread_local Function *Realloc;
+thread_local Function *Free;
+thread_local Value* StringInt;
+thread_local Value* StringLong;
+thread_local Value* StringDouble;
+thread_local unsigned TheOptLevel;
+thread_local const ProgramNode *TheProgram;
+bool TraceCodegen;
+thread_local unsigned ThreadNodeCounts[NodeKindCount];
+atomic<unsigned> NodeCounts[NodeKindCount];
+
+thread_local AstContext *TheAst;
+
+symbol Intern(StringRef name) {
+    auto it = TheAst->symbols.insert({name, TheAst->names.size()});
+    if(it.second)
+        TheAst->names.push_back(name.str());
+    return it.first->second;
+}
 
-Value* VariableNode::codegen() const {
-    cerr << "Entered VariableNode" << endl;
-    Function *f = Builder.GetInsertBlock()->getParent();
+const string &SymbolName(symbol s) {
+    return TheAst->names[s];
+}
+
+static const char *NodeKindNames[NodeKindCount] = {
+    "variable", "int", "double", "assignment", "array assignment", "access array",
+    "modify array", "sequence", "binary operator", "return", "block", "print",
+    "empty", "function call", "if-else", "for loop", "while", "reduction", "function prototype",
+    "function", "program"
+};
+
+/* Counts a generated node and, with --trace-codegen, logs it (buffered) */
+void TraceNode(node_kind kind) {
+    ThreadNodeCounts[(unsigned)kind]++;
+    if(TraceCodegen)
+        clog << "codegen: " << NodeKindNames[(unsigned)kind] << '\n';
+}
 
-    AllocaInst *alloca = NamedValues[f][id_];
-    if (!alloca) {
-        cerr << "Variable doesn't exist: " << id_ << endl;
-        exit(1);
+/* Called by -j workers when their task is done */
+void FlushNodeCounts() {
+    for(unsigned i = 0; i < NodeKindCount; i++) {
+        if(ThreadNodeCounts[i])
+            NodeCounts[i].fetch_add(ThreadNodeCounts[i], memory_order_relaxed);
+        ThreadNodeCounts[i] = 0;
     }
-    return Builder.CreateLoad(alloca);
+}
+
+void PrintNodeCounts() {
+    FlushNodeCounts();
+    clog << "AST nodes generated:\n";
+    for(unsigned i = 0; i < NodeKindCount; i++)
+        if(NodeCounts[i])
+            clog << "  " << NodeKindNames[i] << ": " << NodeCounts[i].load() << '\n';
+    clog.flush();
+}
+/* Heap buffer slots of the function by array, and all of them in order of
+   creation for freeing them on return */
+thread_local ScopeTable<AllocaInst*> HeapSlots;
+thread_local vector<AllocaInst*> HeapSlotList;
+
+/* Exit of the function being generated: returns store their value to
+   ReturnSlot and branch to ReturnBlock. Calls of the function itself in
+   return position store their arguments to ParamSlots and branch to
+   TailCallBlock; for return(x + f(...)) and return(x * f(...)) on ints, x
+   is first folded into Accumulator, which the return block applies */
+thread_local symbol CurrentFunction;
+thread_local BasicBlock *ReturnBlock;
+thread_local BasicBlock *TailCallBlock;
+thread_local AllocaInst *ReturnSlot;
+thread_local AllocaInst *Accumulator;
+thread_local bin_op AccumulatorOp;
+thread_local vector<AllocaInst*> ParamSlots;
+thread_local map<const ExpressionNode*, Value*> HoistedValues;
+extern thread_local map<Function*, TypeEnv> VariableTypes;
+
+/* --checked: array accesses trap on indices out of range. The ranges of
+   the for counters in scope and the length last stored to each array let
+   codegen leave out checks that can't fail */
+thread_local bool CheckBounds;
+thread_local ScopeTable<IndexRange> CounterRanges;
+thread_local ScopeTable<Value*> ArrayLengths;
+thread_local const ExpressionNode *CurrentBody;
+
+Value* VariableNode::codegen() const {
+    TRACE_NODE(variable);
+
+    AllocaInst *alloca = NamedValues.lookup(id_);
+    if (!alloca)
+        ReportError("Variable doesn't exist: " + SymbolName(id_));
+    return Builder->CreateLoad(alloca);
+}
+
+/* Scalars are evaluated once before the loop and broadcast to every lane */
+void ExpressionNode::hoist() const {
+    Value* val = codegen();
+    if(val and val->getType() == Type::getInt1Ty(*TheContext))
+        val = Builder->CreateZExt(val, Type::getInt32Ty(*TheContext));
+    HoistedValues[this] = val;
+}
+
+Type* ExpressionNode::elementType() const {
+    return HoistedValues[this]->getType();
+}
+
+Value* ExpressionNode::elementgen(Value* idx, unsigned width) const {
+    Value* val = HoistedValues[this];
+    return width > 1 ? Builder->CreateVectorSplat(width, val) : val;
+}
+
+bool VariableNode::isArray() const {
+    AllocaInst *alloca = NamedValues.lookup(id_);
+    return alloca and IsArrayDescriptor(alloca->getAllocatedType());
+}
+
+void VariableNode::hoist() const {
+    if(!isArray())
+        return ExpressionNode::hoist();
+    HoistedValues[this] = ArrayDescriptorData(NamedValues.lookup(id_));
+}
+
+Type* VariableNode::elementType() const {
+    if(!isArray())
+        return ExpressionNode::elementType();
+    return cast<PointerType>(HoistedValues[this]->getType())->getElementType();
+}
+
+Value* VariableNode::elementgen(Value* idx, unsigned width) const {
+    if(!isArray())
+        return ExpressionNode::elementgen(idx, width);
+
+    Value* ptr = Builder->CreateGEP(HoistedValues[this], idx);
+    if(width == 1)
+        return Builder->CreateLoad(ptr);
+
+    Type* elem = elementType();
+    ptr = Builder->CreateBitCast(ptr, PointerType::getUnqual(VectorType::get(elem, width)));
+    return Builder->CreateAlignedLoad(ptr, MaybeAlign(TheModule->getDataLayout().getTypeAllocSize(elem)));
+}
+
+Value* VariableNode::lengthgen() const {
+    if(!isArray())
+        return nullptr;
+    return ArrayDescriptorLength(NamedValues.lookup(id_));
 }
 
 Value* IntNode::codegen() const {
-    cerr << "Entered IntNode" << endl;
-    return ConstantInt::get(TheContext, APInt(32, num_));
+    TRACE_NODE(int_);
+    return ConstantInt::get(*TheContext, APInt(isLong() ? 64 : 32, num_, true));
 }
 
 Value* DoubleNode::codegen() const {
-    cerr << "Entered DoubleNode" << endl;
-    return ConstantFP::get(TheContext, APFloat(num_));
+    TRACE_NODE(double_);
+    return ConstantFP::get(*TheContext, APFloat(num_));
 }
 
 
 Value* AssignmentNode::codegen() const {
-    cerr << "Entered AssignmentNode" << endl;
+    TRACE_NODE(assignment);
+    if(e_->isArray())
+        return CreateElementwiseAssignment();
+
     Value *val = e_->codegen();
     if (!val) {
         cerr << "AssignmentNode: nullptr" << endl;
         return nullptr;
     }
-    Function *f = Builder.GetInsertBlock()->getParent();
-    if(NamedValues[f][id_] == nullptr){
-        AllocaInst* alloca = nullptr;
-        if(val->getType() == Type::getInt32Ty(TheContext))
-            alloca = CreateEntryBlockAllocaInt(f, id_);
-        else
-            alloca = CreateEntryBlockAllocaDouble(f, id_);
-
-        Builder.CreateStore(val, alloca);
-
-        NamedValues[f][id_] = alloca;
+    Function *f = Builder->GetInsertBlock()->getParent();
+    AllocaInst* alloca = NamedValues.lookup(id_);
+    if(!alloca or IsArrayDescriptor(alloca->getAllocatedType())) {
+        my_type t = VariableTypes[f][id_];
+        if(IsArrayType(t))
+            t = my_type::int_;
+        t = MergeTypes(t, TypeOf(val->getType()));
+        alloca = CreateEntryBlockAlloca(f, SymbolName(id_), ScalarType(t));
+        NamedValues.set(id_, alloca);
     }
-    else {
-        AllocaInst* alloca = NamedValues[f][id_];
-        if(alloca->getAllocatedType() == Type::getInt32Ty(TheContext) and val->getType() !=  Type::getInt32Ty(TheContext))
-            alloca = CreateEntryBlockAllocaDouble(f, id_);
-
-        Builder.CreateStore(val, alloca);
 
-        NamedValues[f][id_] = alloca;
-    }
+    val = ConvertScalar(val, alloca->getAllocatedType());
+    Builder->CreateStore(val, alloca);
     return val;
 }
 
+/* Generates id_ <- e_ for an array valued e_ as a single fused loop: vector
+   iterations of VectorWidth() lanes and a scalar remainder. The result goes
+   to a fresh heap buffer, the old one is freed afterwards, so e_ may read id_ */
+Value* AssignmentNode::CreateElementwiseAssignment() const {
+    Function *f = Builder->GetInsertBlock()->getParent();
+
+    e_->hoist();
+    Value* length = e_->lengthgen();
+    Type* elem = e_->elementType();
+
+    AllocaInst* slot = GetHeapSlot(f, id_);
+    Value* old = Builder->CreateLoad(slot);
+    Value* bytes = Builder->CreateMul(Builder->CreateZExt(length, Type::getInt64Ty(*TheContext)), ConstantInt::get(*TheContext, APInt(64, TheModule->getDataLayout().getTypeAllocSize(elem))));
+    Value* mem = CreateCheckedRealloc(ConstantPointerNull::get(Type::getInt8PtrTy(*TheContext)), bytes);
+    Value* data = Builder->CreateBitCast(mem, PointerType::getUnqual(elem));
+
+    unsigned align = TheModule->getDataLayout().getTypeAllocSize(elem);
+    CreateVectorLoop(length, VectorWidth(elem), [&](Value* idx, unsigned width) {
+        Value* val = e_->elementgen(idx, width);
+        Value* ptr = Builder->CreateGEP(data, idx);
+        if(width > 1)
+            ptr = Builder->CreateBitCast(ptr, PointerType::getUnqual(VectorType::get(elem, width)));
+        Builder->CreateAlignedStore(val, ptr, MaybeAlign(align));
+    });
+
+    Builder->CreateCall(Free, old);
+    Builder->CreateStore(mem, slot);
+    StoreArrayDescriptor(GetArrayDescriptor(f, id_, elem), data, length);
+    ArrayLengths.set(id_, length);
+
+    return ConstantInt::get(*TheContext, APInt(32, 0));
+}
+
 Value* ArrayAssignmentNode::codegen() const {
-    cerr << "Entered ArrayAssignmentNode" << endl;
-    Function *f = Builder.GetInsertBlock()->getParent();
-    bool is_int = true;
-    for(auto &el: ve_){
-        if(el->codegen()->getType() != Type::getInt32Ty(TheContext)) {
-            is_int = false;
-            break;
-        }
-    }
+    TRACE_NODE(array_assignment);
+    Function *f = Builder->GetInsertBlock()->getParent();
+    my_type t = my_type::int_;
+    for(auto &el: ve_)
+        t = MergeTypes(t, ArrayElementType(el->type(VariableTypes[f])));
+    Type* elem = ScalarType(t);
 
-    AllocaInst* alloca = nullptr;
-    if(is_int)
-        alloca = CreateEntryBlockAllocaIntArray(f, id_, ve_.size());
-    else
-        alloca = CreateEntryBlockAllocaDoubleArray(f, id_, ve_.size());
+    AllocaInst* alloca = CreateEntryBlockAllocaArray(f, SymbolName(id_), elem, ve_.size());
 
     for(unsigned i = 0; i < ve_.size(); i++){
         vector<Value*> s;
-        s.push_back(ConstantInt::get(TheContext, APInt(32, 0)));
-        s.push_back(ConstantInt::get(TheContext, APInt(32, i)));
+        s.push_back(ConstantInt::get(*TheContext, APInt(32, 0)));
+        s.push_back(ConstantInt::get(*TheContext, APInt(32, i)));
 
-        Value* ptr = Builder.CreateGEP(alloca, s);
+        Value* ptr = Builder->CreateGEP(alloca, s);
 
         Value* val = ve_[i]->codegen();
 
-        if(!is_int and val->getType() == Type::getInt32Ty(TheContext))
-            val = Builder.CreateSIToFP(val, Type::getDoubleTy(TheContext));
-        Builder.CreateStore(val, ptr);
+        val = ConvertScalar(val, elem);
+        Builder->CreateStore(val, ptr);
     }
 
-    NamedValues[f][id_] = alloca;
+    Value* length = ConstantInt::get(*TheContext, APInt(32, ve_.size()));
+    StoreArrayDescriptor(GetArrayDescriptor(f, id_, elem), ArrayStorageData(alloca), length);
+    ArrayLengths.set(id_, length);
 
-    return ConstantInt::get(TheContext, APInt(32, 0));
+    return ConstantInt::get(*TheContext, APInt(32, 0));
 }
 
 Value* AccessArrayNode::codegen() const {
-    cerr << "Entered AccessArrayNode" << endl;
-    Function *f = Builder.GetInsertBlock()->getParent();
-
+    TRACE_NODE(access_array);
     Value* index = e_->codegen();
     if(!index)
         return nullptr;
 
-    AllocaInst* alloca = NamedValues[f][id_];
-
-    vector<Value*> s;
-    s.push_back(ConstantInt::get(TheContext, APInt(32, 0)));
-    s.push_back(index);
+    Value* ptr = CreateArrayElementPtr(id_, index, e_);
 
-    Value* ptr = Builder.CreateGEP(alloca, s);
-
-    return Builder.CreateLoad(ptr);
+    return Builder->CreateLoad(ptr);
 }
 
 Value* ModifyArrayNode::codegen() const {
-    cerr << "Entered AccessArrayNode" << endl;
-    Function *f = Builder.GetInsertBlock()->getParent();
-
+    TRACE_NODE(modify_array);
     Value* index = e1_->codegen();
     if(!index)
         return nullptr;
 
-    AllocaInst* alloca = NamedValues[f][id_];
-
-    vector<Value*> s;
-    s.push_back(ConstantInt::get(TheContext, APInt(32, 0)));
-    s.push_back(index);
-
-    Value* ptr = Builder.CreateGEP(alloca, s);
+    Value* ptr = CreateArrayElementPtr(id_, index, e1_);
 
     Value* nval = e2_->codegen();
+    if(!nval)
+        return nullptr;
 
-    Value* oval = Builder.CreateLoad(ptr);
-
-    if(nval->getType() == Type::getInt32Ty(TheContext) and oval->getType() == Type::getDoubleTy(TheContext))
-        nval = Builder.CreateSIToFP(nval, Type::getDoubleTy(TheContext));
+    Type* elem = cast<PointerType>(ptr->getType())->getElementType();
+    nval = ConvertScalar(nval, elem);
 
-    Builder.CreateStore(nval, ptr);
+    Builder->CreateStore(nval, ptr);
 
     return nval;
 }
 
+/* Number of elements of seq(start, end, step), allowing R's 1e-10 for
+   rounding errors; 0 when step goes the wrong way */
+unsigned SequenceLength(double start, double end, double step) {
+    double q = (end - start) / step + 1e-10;
+    if(!(q >= 0 and q < 2147483647.0))
+        return 0;
+    return (unsigned)q + 1;
+}
+
 Value* SequenceNode::codegen() const {
-    cerr << "Entered SequenceNode" << endl;
-    Function *f = Builder.GetInsertBlock()->getParent();
+    TRACE_NODE(sequence);
+    Function *f = Builder->GetInsertBlock()->getParent();
 
     Value* start = start_->codegen();
     if(!start)
         return nullptr;
 
-    if(start->getType() == Type::getInt32Ty(TheContext))
-        start = Builder.CreateSIToFP(start, Type::getDoubleTy(TheContext));
+    Type* dbl = Type::getDoubleTy(*TheContext);
+    start = ConvertScalar(start, dbl);
 
     Value* end = end_->codegen();
     if(!end)
         return nullptr;
 
-    if(end->getType() == Type::getInt32Ty(TheContext))
-        end = Builder.CreateSIToFP(end, Type::getDoubleTy(TheContext));
+    end = ConvertScalar(end, dbl);
 
     Value* step = step_->codegen();
     if(!step)
         return nullptr;
 
-    if(step->getType() == Type::getInt32Ty(TheContext))
-        step = Builder.CreateSIToFP(step, Type::getDoubleTy(TheContext));
-
-    Value* idx = ConstantInt::get(TheContext, APInt(32, 0));
-
-    AllocaInst* alloca = CreateEntryBlockAllocaDoubleVector(f, id_);
-    AllocaInst* allocaIdx = CreateEntryBlockAllocaInt(f, "idx");
-    AllocaInst* allocaStart = CreateEntryBlockAllocaDouble(f, "start");
-    AllocaInst* allocaEnd = CreateEntryBlockAllocaDouble(f, "end");
-    AllocaInst* allocaStep = CreateEntryBlockAllocaDouble(f, "step");
-
-    Builder.CreateStore(idx, allocaIdx);
-    Builder.CreateStore(start, allocaStart);
-    Builder.CreateStore(end, allocaEnd);
-    Builder.CreateStore(step, allocaStep);
-
-    BasicBlock *loop_BB = BasicBlock::Create(TheContext, "loop", f);
-
-    Builder.CreateBr(loop_BB);
-
-    Builder.SetInsertPoint(loop_BB);
-
-    start = Builder.CreateLoad(allocaStart);
-    end = Builder.CreateLoad(allocaEnd);
-    step = Builder.CreateLoad(allocaStep);
-    idx = Builder.CreateLoad(allocaIdx);
-
-    vector<Value*> s;
-    s.push_back(ConstantInt::get(TheContext, APInt(32, 0)));
-    s.push_back(idx);
-
-    Value* ptr = Builder.CreateGEP(alloca, s);
+    step = ConvertScalar(step, dbl);
+
+    /* Short constant sequences live on the stack, others in a heap buffer
+       sized at runtime */
+    Type* elem = ScalarType(sequenceType(VariableTypes[f]));
+    Value* length = nullptr;
+    Value* data = nullptr;
+    ConstantFP* cstart = dyn_cast<ConstantFP>(start);
+    ConstantFP* cend = dyn_cast<ConstantFP>(end);
+    ConstantFP* cstep = dyn_cast<ConstantFP>(step);
+    if(cstart and cend and cstep) {
+        unsigned n = SequenceLength(cstart->getValueAPF().convertToDouble(), cend->getValueAPF().convertToDouble(), cstep->getValueAPF().convertToDouble());
+        length = ConstantInt::get(*TheContext, APInt(32, n));
+        if(n <= MaxStackSequence)
+            data = ArrayStorageData(CreateEntryBlockAllocaArray(f, SymbolName(id_), elem, n));
+        else
+            data = CreateHeapArray(f, id_, elem, length);
+    }
+    else {
+        Value* q = Builder->CreateFAdd(Builder->CreateFDiv(Builder->CreateFSub(end, start), step), ConstantFP::get(*TheContext, APFloat(1e-10)), "seqlen");
+        Value* valid = Builder->CreateAnd(Builder->CreateFCmpOGE(q, ConstantFP::get(*TheContext, APFloat(0.0))), Builder->CreateFCmpOLT(q, ConstantFP::get(*TheContext, APFloat(2147483647.0))));
+        length = Builder->CreateAdd(Builder->CreateFPToSI(q, Type::getInt32Ty(*TheContext)), ConstantInt::get(*TheContext, APInt(32, 1)));
+        length = Builder->CreateSelect(valid, length, ConstantInt::get(*TheContext, APInt(32, 0)), "seqlen");
+        data = CreateHeapArray(f, id_, elem, length);
+    }
 
-    Builder.CreateStore(start, ptr);
+    /* Every element is computed as start + i * step, which keeps the loop
+       free of a floating point recurrence; float elements are rounded
+       from the double */
+    CreateCountedLoop(ConstantInt::get(*TheContext, APInt(32, 0)), length, 1, [&](Value* idx) {
+        Value* val = Builder->CreateFAdd(start, Builder->CreateFMul(Builder->CreateSIToFP(idx, dbl), step), "seqval");
+        Builder->CreateStore(ConvertScalar(val, elem), Builder->CreateGEP(data, idx));
+    });
 
-    start = Builder.CreateFAdd(start, step, "addtmp");
+    StoreArrayDescriptor(GetArrayDescriptor(f, id_, elem), data, length);
+    ArrayLengths.set(id_, length);
 
-    idx = Builder.CreateAdd(idx, ConstantInt::get(TheContext, APInt(32, 1)), "addtmp");
+    return ConstantFP::get(*TheContext, APFloat(0.0));
+}
 
-    Builder.CreateStore(idx, allocaIdx);
-    Builder.CreateStore(start, allocaStart);
+bool BinaryOperatorNode::isArray() const {
+    return l_->isArray() or r_->isArray();
+}
 
-    Value* cond = Builder.CreateFCmpULE(start, end, "leqtmp");
-    cond = Builder.CreateSIToFP(cond, Type::getDoubleTy(TheContext));
-    Value* tmp = Builder.CreateFCmpONE(cond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+void BinaryOperatorNode::hoist() const {
+    if(!isArray())
+        return ExpressionNode::hoist();
+    l_->hoist();
+    r_->hoist();
+}
 
-    BasicBlock *after_loop_BB = BasicBlock::Create(TheContext, "afterloop", f);
-    Builder.CreateCondBr(tmp, loop_BB, after_loop_BB);
+Type* BinaryOperatorNode::elementType() const {
+    if(!isArray())
+        return ExpressionNode::elementType();
+    return MergedType(l_->elementType(), r_->elementType());
+}
 
-    Builder.SetInsertPoint(after_loop_BB);
+Value* BinaryOperatorNode::elementgen(Value* idx, unsigned width) const {
+    if(!isArray())
+        return ExpressionNode::elementgen(idx, width);
 
-    loop_BB = Builder.GetInsertBlock();
+    Value *l = l_->elementgen(idx, width);
+    Value *d = r_->elementgen(idx, width);
+    Type* elem = elementType();
+    Type* t = width > 1 ? (Type*)VectorType::get(elem, width) : elem;
+    l = ConvertScalar(l, t);
+    d = ConvertScalar(d, t);
 
-    NamedValues[f][id_] = alloca;
+    bool is_int = elem->isIntegerTy();
+    switch(op_){
+        case bin_op::plus:
+            return is_int ? Builder->CreateAdd(l, d, "addtmp") : Builder->CreateFAdd(l, d, "addtmp");
+        case bin_op::minus:
+            return is_int ? Builder->CreateSub(l, d, "subtmp") : Builder->CreateFSub(l, d, "subtmp");
+        case bin_op::mul:
+            return is_int ? Builder->CreateMul(l, d, "multmp") : Builder->CreateFMul(l, d, "multmp");
+        case bin_op::di:
+            return is_int ? Builder->CreateSDiv(l, d, "divtmp") : Builder->CreateFDiv(l, d, "divtmp");
+        default:
+            ReportError("Only +, -, * and / work element-wise on arrays");
+    }
+}
 
-    return ConstantFP::get(TheContext, APFloat(0.0));
+/* Arrays of different lengths are combined up to the shorter one */
+Value* BinaryOperatorNode::lengthgen() const {
+    Value* l = l_->lengthgen();
+    Value* d = r_->lengthgen();
+    if(!l)
+        return d;
+    if(!d)
+        return l;
+    return Builder->CreateSelect(Builder->CreateICmpSLT(l, d), l, d, "minlen");
 }
 
 Value* BinaryOperatorNode::codegen() const {
-    cerr << "Entered BinaryOperatorNode" << endl;
+    TRACE_NODE(binary_operator);
+    if(isArray())
+        ReportError("Element-wise array expressions can only be assigned to a variable");
+    if(op_ == bin_op::and_ or op_ == bin_op::or_)
+        return CreateLogicalOperator();
+
     Value *l = l_->codegen();
     Value *d = r_->codegen();
     if (!l || !d) {
         cerr << "BinaryOperatorNode: nullptr" << endl;
         return nullptr;
     }
-    switch(op_){
-        case bin_op::or_: {
-            return Builder.CreateOr(l, d, "ortmp");
-        }
-        case bin_op::and_: {
-            return Builder.CreateOr(l, d, "ortmp");
-        }
-    }
-    if(l->getType() == d->getType() && d->getType() == Type::getInt32Ty(TheContext)){
+    /* Both operands go to the wider type, only mixing integers with floating
+       point converts to floating point; comparison results count as 0 or 1 */
+    Type* t = MergedType(l->getType(), d->getType());
+    l = ConvertScalar(l, t);
+    d = ConvertScalar(d, t);
+    if(t->isIntegerTy()){
         switch(op_){
             case bin_op::plus: {
-                return Builder.CreateAdd(l, d, "addtmp");
+                return Builder->CreateAdd(l, d, "addtmp");
             }
             case bin_op::minus: {
-                return Builder.CreateSub(l, d, "subtmp");
+                return Builder->CreateSub(l, d, "subtmp");
             }
             case bin_op::mul: {
-                return Builder.CreateMul(l, d, "multmp");
+                return Builder->CreateMul(l, d, "multmp");
             }
             case bin_op::di: {
 
-                return Builder.CreateSDiv(l, d, "divtmp");
+                return Builder->CreateSDiv(l, d, "divtmp");
             }
             case bin_op::gt: {
-                return Builder.CreateICmpSGT(l, d, "gttmp");
+                return Builder->CreateICmpSGT(l, d, "gttmp");
             }
             case bin_op::lt: {
-                return Builder.CreateICmpSLT(l, d, "lttmp");
+                return Builder->CreateICmpSLT(l, d, "lttmp");
             }
             case bin_op::geq: {
-                return Builder.CreateICmpSGE(l, d, "geqtmp");
+                return Builder->CreateICmpSGE(l, d, "geqtmp");
             }
             case bin_op::leq: {
-                return Builder.CreateICmpSLE(l, d, "leqtmp");
+                return Builder->CreateICmpSLE(l, d, "leqtmp");
             }
             case bin_op::eq: {
-                return Builder.CreateICmpEQ(l, d, "eqtmp");
+                return Builder->CreateICmpEQ(l, d, "eqtmp");
             }
             case bin_op::neq: {
-                return Builder.CreateICmpNE(l, d, "neqtmp");
+                return Builder->CreateICmpNE(l, d, "neqtmp");
             }
         }
     }
     else {
-        if(l->getType() == Type::getInt32Ty(TheContext))
-            l = Builder.CreateSIToFP(l, Type::getDoubleTy(TheContext));
-        if(d->getType() == Type::getInt32Ty(TheContext))
-            d = Builder.CreateSIToFP(d, Type::getDoubleTy(TheContext));
         switch(op_){
             case bin_op::plus: {
-                return Builder.CreateFAdd(l, d, "addtmp");
+                return Builder->CreateFAdd(l, d, "addtmp");
             }
             case bin_op::minus: {
-                return Builder.CreateFSub(l, d, "subtmp");
+                return Builder->CreateFSub(l, d, "subtmp");
             }
             case bin_op::mul: {
-                return Builder.CreateFMul(l, d, "multmp");
+                return Builder->CreateFMul(l, d, "multmp");
             }
             case bin_op::di: {
-                return Builder.CreateFDiv(l, d, "divtmp");
+                return Builder->CreateFDiv(l, d, "divtmp");
             }
             case bin_op::gt: {
-                return Builder.CreateFCmpUGT(l, d, "gttmp");
+                return Builder->CreateFCmpUGT(l, d, "gttmp");
             }
             case bin_op::lt: {
-                return Builder.CreateFCmpULT(l, d, "lttmp");
+                return Builder->CreateFCmpULT(l, d, "lttmp");
             }
             case bin_op::geq: {
-                return Builder.CreateFCmpUGE(l, d, "geqtmp");
+                return Builder->CreateFCmpUGE(l, d, "geqtmp");
             }
             case bin_op::leq: {
-                return Builder.CreateFCmpULE(l, d, "leqtmp");
+                return Builder->CreateFCmpULE(l, d, "leqtmp");
             }
             case bin_op::eq: {
-                return Builder.CreateFCmpUEQ(l, d, "eqtmp");
+                return Builder->CreateFCmpUEQ(l, d, "eqtmp");
             }
             case bin_op::neq: {
-                return Builder.CreateFCmpUNE(l, d, "neqtmp");
+                return Builder->CreateFCmpUNE(l, d, "neqtmp");
             }
         }
     }
     return nullptr;
 }
 
+/* and/or give an i1 and only evaluate their right side when the left one
+   doesn't decide. A simple right side is evaluated anyway and combined
+   with a select instead of a branch */
+Value* BinaryOperatorNode::CreateLogicalOperator() const {
+    bool is_and = op_ == bin_op::and_;
+    Value* l = CreateCondition(l_->codegen());
+    if(r_->isSimple()) {
+        Value* d = CreateCondition(r_->codegen());
+        return is_and ? Builder->CreateSelect(l, d, Builder->getFalse(), "andtmp") : Builder->CreateSelect(l, Builder->getTrue(), d, "ortmp");
+    }
+
+    Function *f = Builder->GetInsertBlock()->getParent();
+    BasicBlock *lhs_BB = Builder->GetInsertBlock();
+    BasicBlock *rhs_BB = BasicBlock::Create(*TheContext, is_and ? "and.rhs" : "or.rhs", f);
+    BasicBlock *end_BB = BasicBlock::Create(*TheContext, is_and ? "and.end" : "or.end", f);
+    if(is_and)
+        Builder->CreateCondBr(l, rhs_BB, end_BB);
+    else
+        Builder->CreateCondBr(l, end_BB, rhs_BB);
+
+    Builder->SetInsertPoint(rhs_BB);
+    Value* d = CreateCondition(r_->codegen());
+    rhs_BB = Builder->GetInsertBlock();
+    Builder->CreateBr(end_BB);
+
+    Builder->SetInsertPoint(end_BB);
+    PHINode* phi = Builder->CreatePHI(Type::getInt1Ty(*TheContext), 2, is_and ? "andtmp" : "ortmp");
+    phi->addIncoming(is_and ? Builder->getFalse() : Builder->getTrue(), lhs_BB);
+    phi->addIncoming(d, rhs_BB);
+    return phi;
+}
+
+bool VariableNode::isSimple() const {
+    return NamedValues.lookup(id_) and !isArray();
+}
+
+/* Integer division may trap, so it's never simple */
+bool BinaryOperatorNode::isSimple() const {
+    return op_ != bin_op::di and !isArray() and l_->isSimple() and r_->isSimple();
+}
+
+bool AssignmentNode::isSimpleAssignment(symbol &id, const ExpressionNode *&value) const {
+    id = id_;
+    value = e_;
+    return e_->isSimple();
+}
+
+bool BlockNode::isSimpleAssignment(symbol &id, const ExpressionNode *&value) const {
+    return statements_.size() == 1 and statements_[0]->isSimpleAssignment(id, value);
+}
+
+/* Neutral element of a reduction */
+static Value* ReductionIdentity(red_op op, Type* t) {
+    bool is_int = t->isIntegerTy();
+    unsigned bits = t->getPrimitiveSizeInBits();
+    switch(op) {
+        case red_op::prod:
+            return is_int ? (Value*)ConstantInt::get(t, 1) : ConstantFP::get(t, 1.0);
+        case red_op::min:
+            return is_int ? (Value*)ConstantInt::get(*TheContext, APInt::getSignedMaxValue(bits)) : ConstantFP::getInfinity(t, false);
+        case red_op::max:
+            return is_int ? (Value*)ConstantInt::get(*TheContext, APInt::getSignedMinValue(bits)) : ConstantFP::getInfinity(t, true);
+        default:
+            return is_int ? (Value*)ConstantInt::get(t, 0) : ConstantFP::get(t, 0.0);
+    }
+}
+
+/* Folds val into acc, both scalars or both vectors */
+static Value* ReductionCombine(red_op op, Value* acc, Value* val) {
+    bool is_int = acc->getType()->getScalarType()->isIntegerTy();
+    switch(op) {
+        case red_op::prod:
+            return is_int ? Builder->CreateMul(acc, val, "prodtmp") : Builder->CreateFMul(acc, val, "prodtmp");
+        case red_op::min:
+            return Builder->CreateSelect(is_int ? Builder->CreateICmpSLT(val, acc) : Builder->CreateFCmpOLT(val, acc), val, acc, "mintmp");
+        case red_op::max:
+            return Builder->CreateSelect(is_int ? Builder->CreateICmpSGT(val, acc) : Builder->CreateFCmpOGT(val, acc), val, acc, "maxtmp");
+        default:
+            return is_int ? Builder->CreateAdd(acc, val, "sumtmp") : Builder->CreateFAdd(acc, val, "sumtmp");
+    }
+}
+
+/* Reduces an array expression in one pass without temporaries: several
+   independent vector accumulators break the dependency chain, then they are
+   folded together, across lanes and with the scalar remainder */
+Value* ReductionNode::codegen() const {
+    TRACE_NODE(reduction);
+    if(!e_->isArray()) {
+        Value* val = e_->codegen();
+        if(val and op_ == red_op::mean)
+            val = ConvertScalar(val, Type::getDoubleTy(*TheContext));
+        return val;
+    }
+
+    e_->hoist();
+    Value* length = e_->lengthgen();
+    Type* elem = e_->elementType();
+    Type* acc_type = op_ == red_op::mean ? Type::getDoubleTy(*TheContext) : elem;
+    unsigned width = VectorWidth(acc_type);
+    const unsigned Accumulators = 4;
+
+    auto element = [&](Value* idx, unsigned w) {
+        Value* val = e_->elementgen(idx, w);
+        if(acc_type != elem)
+            val = ConvertScalar(val, w > 1 ? (Type*)VectorType::get(acc_type, w) : acc_type);
+        return val;
+    };
+
+    Value* identity = ReductionIdentity(op_, acc_type);
+    vector<Value*> init(Accumulators, Builder->CreateVectorSplat(width, identity));
+    Value* zero = ConstantInt::get(*TheContext, APInt(32, 0));
+    Value* vec_end = Builder->CreateAnd(length, ConstantInt::get(*TheContext, APInt(32, -(int64_t)(width * Accumulators), true)), "vecend");
+    vector<Value*> accs = CreateCountedLoop(zero, vec_end, width * Accumulators, init, [&](Value* idx, const vector<Value*> &accs) {
+        vector<Value*> next;
+        for(unsigned i = 0; i < Accumulators; i++) {
+            Value* lane_idx = Builder->CreateAdd(idx, ConstantInt::get(*TheContext, APInt(32, i * width)));
+            next.push_back(ReductionCombine(op_, accs[i], element(lane_idx, width)));
+        }
+        return next;
+    });
+
+    Value* acc = accs[0];
+    for(unsigned i = 1; i < Accumulators; i++)
+        acc = ReductionCombine(op_, acc, accs[i]);
+    Value* result = Builder->CreateExtractElement(acc, (uint64_t)0);
+    for(unsigned i = 1; i < width; i++)
+        result = ReductionCombine(op_, result, Builder->CreateExtractElement(acc, (uint64_t)i));
+
+    result = CreateCountedLoop(vec_end, length, 1, {result}, [&](Value* idx, const vector<Value*> &accs) {
+        return vector<Value*>{ReductionCombine(op_, accs[0], element(idx, 1))};
+    })[0];
+
+    if(op_ == red_op::mean)
+        result = Builder->CreateFDiv(result, Builder->CreateSIToFP(length, acc_type), "meantmp");
+    return result;
+}
+
+/* Code following a return goes to a block without predecessors */
 Value* ReturnNode::codegen() const {
-    cerr << "Entered ReturnNode" << endl;
-    Function *f = Builder.GetInsertBlock()->getParent();
-    Type* ft = f->getReturnType();
-
-    Value* val = e_->codegen();
-    if(val->getType() == Type::getInt32Ty(TheContext) and ft == Type::getDoubleTy(TheContext))
-        val = Builder.CreateSIToFP(val, Type::getDoubleTy(TheContext));
-    else if(val->getType() == Type::getDoubleTy(TheContext) and ft == Type::getInt32Ty(TheContext))
-        val = Builder.CreateFPToSI(val, Type::getInt32Ty(TheContext));
+    TRACE_NODE(return_);
+    Function *f = Builder->GetInsertBlock()->getParent();
+    Value* val = e_->returngen();
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "afterreturn", f));
     return val;
 }
 
+Value* ExpressionNode::returngen() const {
+    Value* val = codegen();
+    CreateReturn(val);
+    return val;
+}
+
+/* Other functions are called as tail calls, the function itself is jumped
+   to */
+Value* FunctionCallNode::returngen() const {
+    Function *f = Builder->GetInsertBlock()->getParent();
+    if(!isCallTo(CurrentFunction)) {
+        /* Arguments are scalars, the callee never sees our allocas */
+        Value* val = codegen();
+        cast<CallInst>(val)->setTailCall();
+        CreateReturn(val);
+        return val;
+    }
+    tailcallgen();
+    return UndefValue::get(f->getReturnType());
+}
+
+void FunctionCallNode::tailcallgen() const {
+    Function *f = Builder->GetInsertBlock()->getParent();
+    if(f->arg_size() != params_.size())
+        ReportError("Wrong argument size: given " + SymbolName(id_) + ", expected " + to_string(f->arg_size()));
+
+    /* All arguments are evaluated before any parameter changes */
+    vector<Value*> a;
+    for(unsigned i = 0; i < params_.size(); i++)
+        a.push_back(ConvertScalar(params_[i]->codegen(), ParamSlots[i]->getAllocatedType()));
+    for(unsigned i = 0; i < params_.size(); i++)
+        Builder->CreateStore(a[i], ParamSlots[i]);
+    Builder->CreateBr(TailCallBlock);
+}
+
+/* return(x + f(...)) becomes acc = acc + x and a jump, the return block
+   adds acc to the value finally returned; int + and * are associative, so
+   the result is the same. A function accumulates with one
+   operator, returns using another one are generated as calls */
+Value* BinaryOperatorNode::returngen() const {
+    Function *f = Builder->GetInsertBlock()->getParent();
+    if(op_ != bin_op::plus and op_ != bin_op::mul)
+        return ExpressionNode::returngen();
+    if(Accumulator and AccumulatorOp != op_)
+        return ExpressionNode::returngen();
+    Type* t = f->getReturnType();
+    if(!t->isIntegerTy())
+        return ExpressionNode::returngen();
+
+    /* Only x + f(...): x is evaluated before the call's arguments as it
+       would be without the transformation */
+    my_type l_type = l_->type(VariableTypes[f]);
+    if(!r_->isCallTo(CurrentFunction) or (l_type != my_type::int_ and l_type != my_type::long_))
+        return ExpressionNode::returngen();
+
+    if(!Accumulator) {
+        IRBuilder<> TmpB(&f->getEntryBlock(), f->getEntryBlock().begin());
+        Accumulator = TmpB.CreateAlloca(t, 0, "acc");
+        TmpB.SetInsertPoint(f->getEntryBlock().getTerminator());
+        TmpB.CreateStore(ConstantInt::get(t, op_ == bin_op::mul ? 1 : 0), Accumulator);
+        AccumulatorOp = op_;
+    }
+    Value* val = ConvertScalar(l_->codegen(), t);
+    Value* acc = Builder->CreateLoad(Accumulator);
+    Builder->CreateStore(op_ == bin_op::mul ? Builder->CreateMul(acc, val, "acc") : Builder->CreateAdd(acc, val, "acc"), Accumulator);
+    static_cast<const FunctionCallNode*>(r_)->tailcallgen();
+    return UndefValue::get(f->getReturnType());
+}
+
+/* Statements after one that always returns are dead and not generated */
 Value* BlockNode::codegen() const {
-    cerr << "Entered BlockNode" << endl;
-    for(unsigned i = 0; i < statements_.size() - 1; i++) {
-        Value *tmp = statements_[i]->codegen();
+    TRACE_NODE(block);
+    Value *tmp = nullptr;
+    for(auto s: statements_) {
+        tmp = s->codegen();
         if (tmp == nullptr) {
             cerr << "BlockNode: nullptr" << endl;
             return nullptr;
         }
+        if(s->alwaysReturns())
+            break;
     }
-    return statements_[statements_.size() - 1]->codegen();
+    return tmp;
+}
+
+bool BlockNode::alwaysReturns() const {
+    for(auto s: statements_)
+        if(s->alwaysReturns())
+            return true;
+    return false;
+}
+
+unsigned BlockNode::assignments(symbol id) const {
+    unsigned n = 0;
+    for(auto s: statements_)
+        n += s->assignments(id);
+    return n;
+}
+
+bool IfElseNode::alwaysReturns() const {
+    return then_->alwaysReturns() and else_->alwaysReturns();
 }
 
 Value* PrintNode::codegen() const {
-    cerr << "Entered PrintNode" << endl;
+    TRACE_NODE(print);
     Value *e = e_->codegen();
     if (e == nullptr){
         cerr << "PrintNode: nullptr" << endl;
         return nullptr;
     }
 
+    if(e->getType() == Type::getInt1Ty(*TheContext))
+        e = Builder->CreateZExt(e, Type::getInt32Ty(*TheContext));
+
+    /* printf takes floats as doubles */
     vector<Value*> args;
-    if(e->getType() == Type::getInt32Ty(TheContext))
+    if(e->getType() == Type::getInt32Ty(*TheContext))
         args.push_back(StringInt);
+    else if(e->getType() == Type::getInt64Ty(*TheContext))
+        args.push_back(StringLong);
     else
         args.push_back(StringDouble);
-    args.push_back(e);
-    Builder.CreateCall(Printf, args, "printfCall");
+    args.push_back(e->getType()->isFloatTy() ? Builder->CreateFPExt(e, Type::getDoubleTy(*TheContext)) : e);
+    Builder->CreateCall(Printf, args, "printfCall");
 
     return e;
 }
 
 Value* EmptyNode::codegen() const {
-    return ConstantInt::get(TheContext, APInt(32, 0));
+    TRACE_NODE(empty);
+    return ConstantInt::get(*TheContext, APInt(32, 0));
 }
 
 Value* FunctionCallNode::codegen() const {
-    cerr << "Entered FunctionCallNode" << endl;
-    Function* f = TheModule->getFunction(id_);
-    if(!f) {
-        cerr << "Function is not defined: " << id_ << endl;
-        exit(1);
-    }
-    if(f->arg_size() != params_.size()) {
-        cerr << "Wrong argument size: given " << id_ << ", expected " << f->arg_size() << endl ;
-        exit(1);
-    }
+    TRACE_NODE(function_call);
+    Function* f = GetFunction(id_);
+    if(!f)
+        ReportError("Function is not defined: " + SymbolName(id_));
+    if(f->arg_size() != params_.size())
+        ReportError("Wrong argument size: given " + SymbolName(id_) + ", expected " + to_string(f->arg_size()));
 
     vector<Value*> a;
-    for(auto const& value: params_)
-        a.push_back(value->codegen());
+    for(unsigned i = 0; i < params_.size(); i++)
+        a.push_back(ConvertScalar(params_[i]->codegen(), f->getFunctionType()->getParamType(i)));
 
-    return Builder.CreateCall(f, a, "calltmp");
+    return Builder->CreateCall(f, a, "calltmp");
 }
 
 
 Value* IfElseNode::codegen() const {
-    cerr << "Entered IfElseNode" << endl;
+    TRACE_NODE(if_else);
     Value *cond = cond_->codegen();
     if (!cond) {
         cerr << "IfElseNode: nullptr" << endl;
         return nullptr;
     }
 
-    Value* tmp = Builder.CreateFCmpONE(Builder.CreateSIToFP(cond, Type::getDoubleTy(TheContext)), ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+    Value* tmp = CreateCondition(cond);
+
+    /* if(c) { x = a } else { x = b } is x = c ? a : b, without branches,
+       when a and b are simple; a missing else keeps x */
+    symbol id, else_id;
+    const ExpressionNode *then_val, *else_val;
+    if(then_->isSimpleAssignment(id, then_val)) {
+        AllocaInst* alloca = NamedValues.lookup(id);
+        bool has_else = else_->isSimpleAssignment(else_id, else_val) and else_id == id;
+        if(alloca and !IsArrayDescriptor(alloca->getAllocatedType()) and (has_else or else_->isEmpty())) {
+            Type* t = alloca->getAllocatedType();
+            Value* a = ConvertScalar(then_val->codegen(), t);
+            Value* b = has_else ? ConvertScalar(else_val->codegen(), t) : Builder->CreateLoad(alloca);
+            Value* val = Builder->CreateSelect(tmp, a, b, "iftmp");
+            Builder->CreateStore(val, alloca);
+            return val;
+        }
+    }
 
-    Function *f = Builder.GetInsertBlock()->getParent();
-    BasicBlock *thenBB = BasicBlock::Create(TheContext, "then", f);
-    BasicBlock *elseBB = BasicBlock::Create(TheContext, "else");
-    BasicBlock *mergeBB = BasicBlock::Create(TheContext, "ifcont");
+    Function *f = Builder->GetInsertBlock()->getParent();
+    BasicBlock *thenBB = BasicBlock::Create(*TheContext, "then", f);
+    BasicBlock *elseBB = BasicBlock::Create(*TheContext, "else");
+    BasicBlock *mergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-    Builder.CreateCondBr(tmp, thenBB, elseBB);
+    Builder->CreateCondBr(tmp, thenBB, elseBB);
 
-    Builder.SetInsertPoint(thenBB);
+    Builder->SetInsertPoint(thenBB);
     Value* then = then_->codegen();
     if (!then) {
         cerr << "IfElseNode: nullptr" << endl;
         return nullptr;
     }
-    Builder.CreateBr(mergeBB);
-    thenBB = Builder.GetInsertBlock();
+    thenBB = ReachableEnd(then_);
 
     f->getBasicBlockList().push_back(elseBB);
-    Builder.SetInsertPoint(elseBB);
+    Builder->SetInsertPoint(elseBB);
     Value* Else = else_->codegen();
     if (!Else) {
         cerr << "IfElseNode: nullptr" << endl;
         return nullptr;
     }
-    Builder.CreateBr(mergeBB);
-    elseBB = Builder.GetInsertBlock();
+    elseBB = ReachableEnd(else_);
 
-    f->getBasicBlockList().push_back(mergeBB);
-    Builder.SetInsertPoint(mergeBB);
-    PHINode* phi = Builder.CreatePHI(Type::getInt32Ty(TheContext), 2, "iftmp");
-    phi->addIncoming(then, thenBB);
-    phi->addIncoming(Else, elseBB);
+    /* Both branches return: nothing follows */
+    if(!thenBB and !elseBB) {
+        delete mergeBB;
+        Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "afterreturn", f));
+        return then;
+    }
+
+    /* The value has the type of the branches reaching the merge block, ints
+       meeting doubles become doubles */
+    Type* t = thenBB ? then->getType() : Else->getType();
+    t = MergedType(t, elseBB ? Else->getType() : t);
 
+    f->getBasicBlockList().push_back(mergeBB);
+    PHINode* phi = nullptr;
+    if(t) {
+        Builder->SetInsertPoint(mergeBB);
+        phi = Builder->CreatePHI(t, 2, "iftmp");
+    }
+    if(thenBB) {
+        Builder->SetInsertPoint(thenBB);
+        if(phi)
+            phi->addIncoming(ConvertScalar(then, t), Builder->GetInsertBlock());
+        Builder->CreateBr(mergeBB);
+    }
+    if(elseBB) {
+        Builder->SetInsertPoint(elseBB);
+        if(phi)
+            phi->addIncoming(ConvertScalar(Else, t), Builder->GetInsertBlock());
+        Builder->CreateBr(mergeBB);
+    }
+    Builder->SetInsertPoint(mergeBB);
+    if(!phi)
+        return ConstantInt::get(*TheContext, APInt(32, 0));
     return phi;
 }
 
 
+/* for(i in a:b) counts from a to b, down when a > b as in R, so the range
+   is never empty. Both bounds are evaluated once, before the loop, which
+   runs a canonical counter k from 0 to |b - a| next to i itself: the body
+   gets i in a variable of its own and may change it without affecting
+   the iteration */
 Value* ForLoopNode::codegen() const {
-    cerr << "Entered ForLoopNode" << endl;
+    TRACE_NODE(for_loop);
+    Function *f = Builder->GetInsertBlock()->getParent();
+    Type* t = ScalarType(counterType(VariableTypes[f]));
+
     Value* start_val = start_->codegen();
-    if (!start_val){
+    Value* end_val = end_->codegen();
+    if (!start_val or !end_val){
         cerr << "ForLoopNode: nullptr" << endl;
         return nullptr;
     }
-    Function *f = Builder.GetInsertBlock()->getParent();
-    BasicBlock *loop_BB = BasicBlock::Create(TheContext, "loop", f);
-
-    AllocaInst* alloca = CreateEntryBlockAllocaInt(f, id_);
-    Builder.CreateStore(start_val, alloca);
-    Builder.CreateBr(loop_BB);
+    Value* start = ConvertScalar(start_val, t);
+    Value* end = ConvertScalar(end_val, t);
+    Value* down = Builder->CreateICmpSGT(start, end, "down");
+    Value* step = Builder->CreateSelect(down, ConstantInt::get(t, -1, true), ConstantInt::get(t, 1), "step");
+    Value* last = Builder->CreateSelect(down, Builder->CreateSub(start, end), Builder->CreateSub(end, start), "last");
+
+    /* Unless the body assigns i, bounds checks of indices depending on it
+       can be done for the whole range here */
+    IndexRange range;
+    vector<Value*> checks;
+    if(CheckBounds and !body_->assignments(id_)) {
+        Type* i64 = Type::getInt64Ty(*TheContext);
+        range.lo = Builder->CreateSExt(Builder->CreateSelect(down, end, start), i64, "lo");
+        range.hi = Builder->CreateSExt(Builder->CreateSelect(down, start, end), i64, "hi");
+        range.body = body_;
+        range.preheader = Builder->GetInsertBlock();
+        range.narrow = t->isIntegerTy(32);
+        range.checks = &checks;
+    }
 
-    Builder.SetInsertPoint(loop_BB);
-    AllocaInst* old_val = NamedValues[f][id_];
-    NamedValues[f][id_] = alloca;
+    AllocaInst* alloca = CreateEntryBlockAlloca(f, SymbolName(id_), t);
+    BasicBlock *pre_BB = Builder->GetInsertBlock();
+    BasicBlock *loop_BB = BasicBlock::Create(*TheContext, "loop", f);
+    BasicBlock *after_loop_BB = BasicBlock::Create(*TheContext, "afterloop");
+    Builder->CreateBr(loop_BB);
 
-    Value* body_val = body_->codegen();
-    if (!body_val) {
-        cerr << "ForLoopNode: nullptr" << endl;
+    BasicBlock *latch_BB;
+    Value* body_val = loopgen(loop_BB, pre_BB, alloca, start, step, last, range, after_loop_BB, latch_BB);
+    if (!body_val)
         return nullptr;
+
+    /* A body that always returns leaves after the first iteration */
+    if(!latch_BB) {
+        delete after_loop_BB;
+        Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "afterreturn", f));
+        return body_val;
     }
-    Value* inc_val = ConstantInt::get(TheContext, APInt(32, 1));
-    if (!inc_val) {
-        cerr << "ForLoopNode: nullptr" << endl;
-        return nullptr;
+
+    /* The preheader branches once: when every range checked there is valid,
+       to a second copy of the loop that doesn't check those indices again */
+    if(!checks.empty()) {
+        BasicBlock *unchecked_BB = BasicBlock::Create(*TheContext, "loopinbounds", f);
+        range.checks = nullptr;
+        if (!loopgen(unchecked_BB, pre_BB, alloca, start, step, last, range, after_loop_BB, latch_BB))
+            return nullptr;
+
+        Instruction *br = pre_BB->getTerminator();
+        IRBuilder<> PB(br);
+        Value* ok = checks[0];
+        for(unsigned n = 1; n < checks.size(); n++)
+            ok = PB.CreateAnd(ok, checks[n]);
+        PB.CreateCondBr(ok, unchecked_BB, loop_BB);
+        br->eraseFromParent();
     }
-    Value *curr_val = Builder.CreateLoad(alloca);
-    Value* next_var = Builder.CreateAdd(curr_val, inc_val, "nextvar");
-    Builder.CreateStore(next_var, alloca);
 
-    Value* end = end_->codegen();
-    if(end->getType() == Type::getDoubleTy(TheContext))
-        end = Builder.CreateFPToSI(end, Type::getInt32Ty(TheContext));
+    f->getBasicBlockList().push_back(after_loop_BB);
+    Builder->SetInsertPoint(after_loop_BB);
+    return ConstantInt::get(*TheContext, APInt(32, 0));
+}
 
-    Value* cond = Builder.CreateICmpSLT(curr_val, end, "leqtmp");
-    if (!cond){
+/* One copy of the loop, entered from pre_BB at loop_BB and left to
+   after_BB; latch_BB is the end of its body, null when that always
+   returns */
+Value* ForLoopNode::loopgen(BasicBlock *loop_BB, BasicBlock *pre_BB, AllocaInst *alloca, Value *start, Value *step,
+                            Value *last, const IndexRange &range, BasicBlock *after_BB, BasicBlock *&latch_BB) const {
+    Type* t = alloca->getAllocatedType();
+    Builder->SetInsertPoint(loop_BB);
+    PHINode* k = Builder->CreatePHI(t, 2, "k");
+    PHINode* i = Builder->CreatePHI(t, 2, SymbolName(id_));
+    k->addIncoming(ConstantInt::get(t, 0), pre_BB);
+    i->addIncoming(start, pre_BB);
+    Builder->CreateStore(i, alloca);
+
+    NamedValues.enterScope();
+    NamedValues.define(id_, alloca);
+    CounterRanges.enterScope();
+    CounterRanges.define(id_, range);
+    Value* body_val = body_->codegen();
+    CounterRanges.leaveScope();
+    NamedValues.leaveScope();
+    if (!body_val) {
         cerr << "ForLoopNode: nullptr" << endl;
         return nullptr;
     }
-    Value* tmp = Builder.CreateFCmpONE(Builder.CreateSIToFP(cond, Type::getDoubleTy(TheContext)), ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
-
-    BasicBlock *after_loop_BB = BasicBlock::Create(TheContext, "afterloop", f);
-    Builder.CreateCondBr(tmp, loop_BB, after_loop_BB);
 
-    Builder.SetInsertPoint(after_loop_BB);
-
-    loop_BB = Builder.GetInsertBlock();
+    latch_BB = ReachableEnd(body_);
+    if(!latch_BB)
+        return body_val;
+    k->addIncoming(Builder->CreateAdd(k, ConstantInt::get(t, 1), "nextk"), latch_BB);
+    i->addIncoming(Builder->CreateAdd(i, step, "nextvar"), latch_BB);
+    Value* done = Builder->CreateICmpEQ(k, last, "loopdone");
+    Builder->CreateCondBr(done, after_BB, loop_BB);
+    return body_val;
+}
 
-    if (old_val != nullptr)
-        NamedValues[f][id_] = old_val;
-    else
-        NamedValues[f].erase(id_);
-    return ConstantInt::get(TheContext, APInt(32, 0));
+bool ForLoopNode::alwaysReturns() const {
+    return body_->alwaysReturns();
 }
 
 Value* WhileNode::codegen() const {
-    cerr << "Entered WhileNode" << endl;
+    TRACE_NODE(while_);
 
-    Function *f = Builder.GetInsertBlock()->getParent();
-    BasicBlock *loop_BB = BasicBlock::Create(TheContext, "loop", f);
-    Builder.CreateBr(loop_BB);
+    Function *f = Builder->GetInsertBlock()->getParent();
+    BasicBlock *loop_BB = BasicBlock::Create(*TheContext, "loop", f);
+    Builder->CreateBr(loop_BB);
 
-    Builder.SetInsertPoint(loop_BB);
+    Builder->SetInsertPoint(loop_BB);
 
     Value* body = body_->codegen();
     if (!body)
@@ -507,126 +1025,749 @@ Value* WhileNode::codegen() const {
     if (!cond)
         return NULL;
 
-    Value* tmp = Builder.CreateFCmpONE(Builder.CreateSIToFP(cond, Type::getDoubleTy(TheContext)), ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+    Value* tmp = CreateCondition(cond);
 
-    BasicBlock *after_loop_BB = BasicBlock::Create(TheContext, "afterloop", f);
-    Builder.CreateCondBr(tmp, loop_BB, after_loop_BB);
+    BasicBlock *after_loop_BB = BasicBlock::Create(*TheContext, "afterloop", f);
+    Builder->CreateCondBr(tmp, loop_BB, after_loop_BB);
 
-    Builder.SetInsertPoint(after_loop_BB);
+    Builder->SetInsertPoint(after_loop_BB);
 
-    loop_BB = Builder.GetInsertBlock();
+    loop_BB = Builder->GetInsertBlock();
 
-    return ConstantInt::get(TheContext, APInt(32, 0));
+    return ConstantInt::get(*TheContext, APInt(32, 0));
 }
 
 Function* FunctionPrototypeNode::codegen() const {
-    cerr << "Entered FunctionPrototypeNode" << endl;
+    TRACE_NODE(function_prototype);
     vector<Type*> d;
-    for(int i = 0; i < params_.size(); i++){
-        if(params_[i].first == my_type::int_)
-            d.push_back(Type::getInt32Ty(TheContext));
-        else
-            d.push_back(Type::getDoubleTy(TheContext));
-    }
-    FunctionType *ft = nullptr;
-    if(ret_type_ == my_type::int_)
-        ft = FunctionType::get(Type::getInt32Ty(TheContext), d, false);
-    else
-        ft = FunctionType::get(Type::getDoubleTy(TheContext), d, false);
-    Function *f = Function::Create(ft, Function::ExternalLinkage, id_, TheModule);
+    for(int i = 0; i < params_.size(); i++)
+        d.push_back(ScalarType(params_[i].first));
+    FunctionType *ft = FunctionType::get(ScalarType(ret_type_), d, false);
+    Function *f = Function::Create(ft, Function::ExternalLinkage, SymbolName(id_), TheModule);
 
     unsigned i = 0;
     for (auto &arg : f->args())
-        arg.setName(params_[i++].second);
+        arg.setName(SymbolName(params_[i++].second));
+    return f;
+}
+
+
+/* Adds the function's prototype to the module, bodies come later */
+Function* FunctionNode::declare() const {
+    Function* f = prototype_.codegen();
+    if(!f)
+        ReportError("Can't generate code for function: " + prototype_.getName());
+    if(prototype_.getName() == "main")
+        Main = f;
     return f;
 }
 
+void FunctionNode::inferTypes() const {
+    Function* f = TheModule->getFunction(prototype_.getName());
+    TypeEnv params;
+    for(auto &param : prototype_.getParams())
+        params[param.second] = param.first;
+    InferVariableTypes(f, body_, params);
+}
 
 Function* FunctionNode::codegen() const {
-    cerr << "Entered FunctionNode" << endl;
+    TRACE_NODE(function);
     Function* f = TheModule->getFunction(prototype_.getName());
-    if(!f)
-        f = prototype_.codegen();
 
-    if(!f) {
-        cerr << "Can't generate code for function: " << prototype_.getName() << endl;
-        exit(1);
+    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", f);
+    Builder->SetInsertPoint(BB);
+
+    StringInt = Builder->CreateGlobalStringPtr("%d\n");
+    StringLong = Builder->CreateGlobalStringPtr("%ld\n");
+    StringDouble = Builder->CreateGlobalStringPtr(f == Main ? "%lf\n" : "%.2lf\n");
+
+    NamedValues.clear();
+    HeapSlots.clear();
+    HeapSlotList.clear();
+    ParamSlots.clear();
+    CounterRanges.clear();
+    ArrayLengths.clear();
+    CurrentBody = body_;
+
+    auto params = prototype_.getParams();
+    for(auto &arg : f->args()) {
+        symbol id = params[arg.getArgNo()].second;
+        my_type t = VariableTypes[f][id];
+        if(IsArrayType(t))
+            t = params[arg.getArgNo()].first;
+        AllocaInst* alloca = CreateEntryBlockAlloca(f, SymbolName(id), ScalarType(t));
+        NamedValues.set(id, alloca);
+        ParamSlots.push_back(alloca);
+        Builder->CreateStore(ConvertScalar(&arg, alloca->getAllocatedType()), alloca);
     }
 
-    if(!f->empty()) {
-        cerr << "Can't redefine function: " << prototype_.getName() << endl;
-        exit(1);
+    /* The body starts after the entry block, self tail calls jump back
+       there; every return ends up in one return block */
+    CurrentFunction = prototype_.getId();
+    ReturnSlot = CreateEntryBlockAlloca(f, "retval", f->getReturnType());
+    ReturnBlock = BasicBlock::Create(*TheContext, "return");
+    TailCallBlock = BasicBlock::Create(*TheContext, "tailrecurse", f);
+    Accumulator = nullptr;
+    Builder->CreateBr(TailCallBlock);
+    Builder->SetInsertPoint(TailCallBlock);
+
+    /* main returns 0 unless it returns something else */
+    Value* ret_val = body_->codegen();
+    if(f == Main)
+        ret_val = ConstantInt::get(*TheContext, APInt(32, 0));
+    if(!ret_val) {
+        f->eraseFromParent();
+        return nullptr;
     }
+    if(body_->alwaysReturns())
+        ReachableEnd(body_);
+    else
+        CreateReturn(ret_val);
+
+    f->getBasicBlockList().push_back(ReturnBlock);
+    Builder->SetInsertPoint(ReturnBlock);
+    Value* val = Builder->CreateLoad(ReturnSlot, "retval");
+    if(Accumulator) {
+        Value* acc = Builder->CreateLoad(Accumulator);
+        val = AccumulatorOp == bin_op::mul ? Builder->CreateMul(acc, val, "accret") : Builder->CreateAdd(acc, val, "accret");
+    }
+    CreateFunctionReturn(val);
+    FinishFunction(f);
+    return f;
+}
 
-    BasicBlock *BB = BasicBlock::Create(TheContext, "entry", f);
-    Builder.SetInsertPoint(BB);
+ProgramNode::ProgramNode(ArrayRef<FunctionNode*> vf)
+    : functions_(vf)
+{
+    vector<const FunctionNode*> definitions(TheAst->names.size());
+    for(auto f: functions_) {
+        symbol id = f->getPrototype().getId();
+        if(definitions[id])
+            ReportError("Can't redefine function: " + f->getName());
+        definitions[id] = f;
+    }
+    definitions_ = CopyToArena(definitions);
+}
 
-    StringInt = Builder.CreateGlobalStringPtr("%d\n");
-    StringDouble = Builder.CreateGlobalStringPtr("%.2lf\n");
+/* User function id in TheModule, declared from its definition the first
+   time it's referred to */
+Function *GetFunction(symbol id) {
+    Function* f = TheModule->getFunction(SymbolName(id));
+    if(f)
+        return f;
+    const FunctionNode* definition = TheProgram ? TheProgram->lookup(id) : nullptr;
+    return definition ? definition->declare() : nullptr;
+}
 
-    NamedValues[f].clear();
-    for(auto &arg : f->args()) {
-        AllocaInst* alloca = nullptr;
-        if(arg.getType() == Type::getInt32Ty(TheContext))
-            alloca = CreateEntryBlockAllocaInt(f, arg.getName());
-        else
-            alloca = CreateEntryBlockAllocaDouble(f, arg.getName());
-        NamedValues[f][arg.getName()] = alloca;
-        Builder.CreateStore(&arg, alloca);
+/* Generates functions [begin, end) into TheModule. Their prototypes are
+   declared before any body is generated and the other functions when they
+   are first called, so functions may be called before their definition and
+   from other shards */
+void ProgramNode::generate(unsigned begin, unsigned end) const {
+    TheProgram = this;
+    for(unsigned i = begin; i < end; i++)
+        functions_[i]->declare();
+    for(unsigned i = begin; i < end; i++)
+        functions_[i]->inferTypes();
+    for(unsigned i = begin; i < end; i++)
+        functions_[i]->codegen();
+}
+
+void ProgramNode::generateEntries(ArrayRef<const FunctionNode*> functions) const {
+    TheProgram = this;
+    for(auto f: functions)
+        f->declare();
+    for(auto f: functions)
+        f->inferTypes();
+    for(auto f: functions)
+        f->codegen();
+    for(auto f: functions)
+        CreateEntryThunk(TheModule->getFunction(f->getName()));
+}
+
+/* Links generated bitcode into TheModule in order, then puts the
+   definitions of [begin, end) back in source order, as linking appends
+   them */
+void ProgramNode::link(ArrayRef<MemoryBufferRef> bitcode, unsigned begin, unsigned end) const {
+    for(auto &b: bitcode) {
+        auto M = parseBitcodeFile(b, *TheContext);
+        if(!M)
+            ReportError("Can't read generated code: " + toString(M.takeError()));
+        if(Linker::linkModules(*TheModule, move(*M)))
+            ReportError("Can't link generated code");
     }
 
-    Value* ret_val;
-    if((ret_val = body_->codegen())) {
-        Builder.CreateRet(ret_val);
-        verifyFunction(*f);
+    for(unsigned i = begin; i < end; i++) {
+        Function *fn = TheModule->getFunction(functions_[i]->getName());
+        fn->removeFromParent();
+        TheModule->getFunctionList().push_back(fn);
+    }
+    Main = TheModule->getFunction("main");
+}
 
-        return f;
+/* Generates functions [begin, end) into TheModule once everything is parsed.
+   With more than one job and enough functions they are split into
+   contiguous shards of at least MinFunctionsPerShard, each
+   generated and optimized on its own thread in its own context; the shards
+   come back as bitcode and are linked into TheModule in order, so the
+   output doesn't depend on scheduling */
+void ProgramNode::codegen(unsigned begin, unsigned end, unsigned Jobs) const {
+    TRACE_NODE(program);
+    PhaseTimer t(phase::codegen);
+    unsigned count = end - begin;
+    unsigned chunk = max((count + Jobs - 1) / max(Jobs, 1u), MinFunctionsPerShard);
+    if(Jobs <= 1 or chunk >= count) {
+        generate(begin, end);
+        return;
     }
-    else {
-        f->eraseFromParent();
-        return nullptr;
+
+    unsigned shards = (count + chunk - 1) / chunk;
+    vector<SmallVector<char, 0>> bitcode(shards);
+    TargetMachine *TM = TheTargetMachine;
+    unsigned OptLevel = TheOptLevel;
+    bool Checked = CheckBounds;
+    AstContext *Ast = TheAst;
+    WorkerErrors errors;
+    {
+        ThreadPool pool(shards);
+        for(unsigned s = 0; s < shards; s++)
+            pool.async([&, s] {
+                TheAst = Ast;
+                InitializeModuleAndPassManager(OptLevel, Checked, CloneTargetMachine(TM));
+                try {
+                    generate(begin + s * chunk, min(begin + (s + 1) * chunk, end));
+                    raw_svector_ostream os(bitcode[s]);
+                    WriteBitcodeToFile(*TheModule, os);
+                }
+                catch(const CompileError &e) {
+                    errors.add(e);
+                }
+                FreeModuleAndPassManager();
+                FlushNodeCounts();
+                TheAst = nullptr;
+            });
+        pool.wait();
+    }
+    errors.rethrow();
+
+    vector<MemoryBufferRef> shard_refs;
+    for(auto &b: bitcode)
+        shard_refs.push_back(MemoryBufferRef(StringRef(b.data(), b.size()), "shard"));
+    link(shard_refs, begin, end);
+}
+
+/* Incremental variant for recompiling edited sources: functions whose
+   fingerprint is in Code are linked from there, the others are generated
+   on up to Jobs threads, each into a module of its own, and added to Code */
+void ProgramNode::codegen(unsigned begin, unsigned end, unsigned Jobs, FunctionCode &Code) const {
+    TRACE_NODE(program);
+    PhaseTimer t(phase::codegen);
+    vector<string> keys;
+    vector<unsigned> missing;
+    for(unsigned i = begin; i < end; i++) {
+        keys.push_back(fingerprint(i));
+        if(!Code.count(keys.back()))
+            missing.push_back(i);
     }
+
+    if(!missing.empty()) {
+        unsigned workers = min(max(Jobs, 1u), (unsigned)missing.size());
+        unsigned chunk = max((unsigned)(missing.size() + workers - 1) / workers, MinFunctionsPerShard);
+        workers = (missing.size() + chunk - 1) / chunk;
+        vector<SmallVector<char, 0>> bitcode(missing.size());
+        TargetMachine *TM = TheTargetMachine;
+        unsigned OptLevel = TheOptLevel;
+        bool Checked = CheckBounds;
+        AstContext *Ast = TheAst;
+        WorkerErrors errors;
+        {
+            ThreadPool pool(workers);
+            for(unsigned w = 0; w < workers; w++)
+                pool.async([&, w] {
+                    TheAst = Ast;
+                    InitializeModuleAndPassManager(OptLevel, Checked, CloneTargetMachine(TM));
+                    try {
+                        for(unsigned m = w * chunk; m < min((w + 1) * chunk, (unsigned)missing.size()); m++) {
+                            generate(missing[m], missing[m] + 1);
+                            raw_svector_ostream os(bitcode[m]);
+                            WriteBitcodeToFile(*TheModule, os);
+                            FreeModule();
+                            InitializeModule();
+                        }
+                    }
+                    catch(const CompileError &e) {
+                        errors.add(e);
+                    }
+                    FreeModuleAndPassManager();
+                    FlushNodeCounts();
+                    TheAst = nullptr;
+                });
+            pool.wait();
+        }
+        errors.rethrow();
+        for(unsigned m = 0; m < missing.size(); m++)
+            Code[keys[missing[m] - begin]] = MemoryBuffer::getMemBufferCopy(StringRef(bitcode[m].data(), bitcode[m].size()));
+    }
+
+    vector<MemoryBufferRef> function_refs;
+    for(auto &key: keys)
+        function_refs.push_back(Code[key]->getMemBufferRef());
+    link(function_refs, begin, end);
 }
 
 
-void InitializeModuleAndPassManager() {
-    TheModule = new llvm::Module("Module", TheContext);
+/* Sets up the calling thread's context, module and pass manager */
+void InitializeModuleAndPassManager(unsigned OptLevel, bool Checked, TargetMachine *TM) {
+    TheContext = make_unique<LLVMContext>();
+    Builder = make_unique<IRBuilder<>>(*TheContext);
+    TheOptLevel = OptLevel;
+    CheckBounds = Checked;
+    TheTargetMachine = TM;
+    InitializeModule();
+}
+
+/* Starts a new module and pass manager in the calling thread's context */
+void InitializeModule() {
+    TheModule = new llvm::Module("Module", *TheContext);
+    Main = nullptr;
+
+    TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+
     TheFPM = new llvm::legacy::FunctionPassManager(TheModule);
+    TheFPM->add(createTargetTransformInfoWrapperPass(TheTargetMachine->getTargetIRAnalysis()));
 
-    TheFPM->add(createInstructionCombiningPass());
-    TheFPM->add(createReassociatePass());
-    TheFPM->add(createNewGVNPass());
-    TheFPM->add(createCFGSimplificationPass());
+    /* Variables always end up in registers, even at -O0 */
+    if(TheOptLevel > 1) {
+        TheFPM->add(createSROAPass());
+        TheFPM->add(createEarlyCSEPass());
+    }
+    else
+        TheFPM->add(createPromoteMemoryToRegisterPass());
+    if(TheOptLevel > 0) {
+        TheFPM->add(createInstructionCombiningPass());
+        TheFPM->add(createReassociatePass());
+        TheFPM->add(createNewGVNPass());
+        TheFPM->add(createCFGSimplificationPass());
+        TheFPM->add(createTailCallEliminationPass());
+    }
     TheFPM->doInitialization();
+
+    FunctionType *FT1 = FunctionType::get(IntegerType::getInt32Ty(*TheContext), PointerType::get(Type::getInt8Ty(*TheContext), 0), true);
+    Printf = Function::Create(FT1, Function::ExternalLinkage, "printf", TheModule);
+    FunctionType *FT3 = FunctionType::get(Type::getInt8PtrTy(*TheContext), {Type::getInt8PtrTy(*TheContext), Type::getInt64Ty(*TheContext)}, false);
+    Realloc = Function::Create(FT3, Function::ExternalLinkage, "realloc", TheModule);
+    FunctionType *FT4 = FunctionType::get(Type::getVoidTy(*TheContext), Type::getInt8PtrTy(*TheContext), false);
+    Free = Function::Create(FT4, Function::ExternalLinkage, "free", TheModule);
 }
 
-AllocaInst *CreateEntryBlockAllocaInt(Function *TheFunction, const string &VarName) {
-    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getInt32Ty(TheContext), 0, VarName.c_str());
+/* Releases the calling thread's module, pass manager, target machine and
+   context */
+void FreeModuleAndPassManager() {
+    FreeModule();
+    delete TheTargetMachine;
+    TheTargetMachine = nullptr;
+    Builder.reset();
+    TheContext.reset();
 }
 
-AllocaInst *CreateEntryBlockAllocaDouble(Function *TheFunction, const string &VarName) {
-    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), 0, VarName.c_str());
+/* Releases the module and pass manager, keeping the context */
+void FreeModule() {
+    delete TheFPM;
+    delete TheModule;
+    TheFPM = nullptr;
+    TheModule = nullptr;
+    NamedValues.clear();
+    HeapSlots.clear();
+    HeapSlotList.clear();
+    CounterRanges.clear();
+    ArrayLengths.clear();
+    HoistedValues.clear();
+    VariableTypes.clear();
+}
+
+/* Block where the code generated for e ends, nullptr when e always
+   returns: the block after the return is then removed, it's empty and has
+   no predecessors */
+BasicBlock *ReachableEnd(const ExpressionNode *e) {
+    BasicBlock *BB = Builder->GetInsertBlock();
+    if(!e->alwaysReturns())
+        return BB;
+    BB->eraseFromParent();
+    return nullptr;
+}
+
+/* Type of a value coming from either a or b: the wider of two scalar
+   types, i1 counting as i32. nullptr for other mismatches */
+Type *MergedType(Type *a, Type *b) {
+    auto scalar = [](Type *t) { return t->isIntegerTy() or t->isFloatingPointTy(); };
+    if(scalar(a) and scalar(b))
+        return ScalarType(MergeTypes(TypeOf(a), TypeOf(b)));
+    return a == b ? a : nullptr;
+}
+
+/* Truth value of a condition as an i1: comparisons already are one, other
+   values are true unless zero */
+Value *CreateCondition(Value *val) {
+    if(val->getType() == Type::getInt1Ty(*TheContext))
+        return val;
+    if(val->getType()->isFloatingPointTy())
+        return Builder->CreateFCmpUNE(val, ConstantFP::get(val->getType(), 0.0), "cond");
+    return Builder->CreateICmpNE(val, ConstantInt::get(val->getType(), 0), "cond");
+}
+
+/* Converts a scalar (i1, i32, i64, float or double) to the scalar type t,
+   or a vector of them to the vector type t of the same width. Integers are
+   sign extended or truncated, floating point rounds */
+Value *ConvertScalar(Value *val, Type *t) {
+    if(val->getType() == Type::getInt1Ty(*TheContext))
+        val = Builder->CreateZExt(val, Type::getInt32Ty(*TheContext));
+    Type *from = val->getType()->getScalarType(), *to = t->getScalarType();
+    if(val->getType() == t or !(from->isIntegerTy() or from->isFloatingPointTy()))
+        return val;
+    if(from->isIntegerTy() and to->isIntegerTy())
+        return Builder->CreateSExtOrTrunc(val, t);
+    if(from->isIntegerTy() and to->isFloatingPointTy())
+        return Builder->CreateSIToFP(val, t);
+    if(from->isFloatingPointTy() and to->isIntegerTy())
+        return Builder->CreateFPToSI(val, t);
+    if(to->isFloatingPointTy())
+        return Builder->CreateFPCast(val, t);
+    return val;
+}
+
+/* Verifies a generated function and runs the per-function passes on it */
+void FinishFunction(Function *f) {
+    string problems;
+    bool broken;
+    {
+        PhaseTimer t(phase::verify);
+        raw_string_ostream os(problems);
+        broken = verifyFunction(*f, &os);
+    }
+    if(broken)
+        ReportError("Generated invalid code for " + f->getName().str() + ":\n" + problems);
+    RecordFunctionStats(f);
+    OptimizeFunction(f);
 }
 
-AllocaInst *CreateEntryBlockAllocaIntArray(Function *TheFunction, const string &VarName, unsigned size) {
-    Type* I = IntegerType::getInt32Ty(TheContext);
-    ArrayType* arrayType = ArrayType::get(I, size);
+/* Runs the per-function passes right after a function body is generated */
+void OptimizeFunction(Function *f) {
+    PhaseTimer t(phase::optimize_function);
+    TheFPM->run(*f);
+}
+
+/* Runs the whole-module pipeline (inlining, loop passes, vectorizers) */
+void OptimizeModule() {
+    TheFPM->doFinalization();
+    if(TheOptLevel == 0)
+        return;
+
+    PhaseTimer t(phase::optimize_module);
+    PassManagerBuilder PMB;
+    PMB.OptLevel = TheOptLevel;
+    PMB.SizeLevel = 0;
+    PMB.Inliner = createFunctionInliningPass(TheOptLevel, 0, false);
+    PMB.LoopVectorize = TheOptLevel > 1;
+    PMB.SLPVectorize = TheOptLevel > 1;
+    TheTargetMachine->adjustPassManager(PMB);
+
+    llvm::legacy::PassManager MPM;
+    MPM.add(createTargetTransformInfoWrapperPass(TheTargetMachine->getTargetIRAnalysis()));
+    PMB.populateModulePassManager(MPM);
+    MPM.run(*TheModule);
+}
+
+AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, const string &VarName, Type *t) {
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(arrayType, 0, VarName.c_str());
+    return TmpB.CreateAlloca(t, 0, VarName.c_str());
 }
 
-AllocaInst *CreateEntryBlockAllocaDoubleArray(Function *TheFunction, const string &VarName, unsigned size) {
-    Type* I = Type::getDoubleTy(TheContext);
-    ArrayType* arrayType = ArrayType::get(I, size);
+AllocaInst *CreateEntryBlockAllocaArray(Function *TheFunction, const string &VarName, Type *elem, unsigned size) {
+    ArrayType* arrayType = ArrayType::get(elem, size);
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
     return TmpB.CreateAlloca(arrayType, 0, VarName.c_str());
 }
 
-AllocaInst *CreateEntryBlockAllocaDoubleVector(Function * TheFunction, const string &VarName) {
-    Type* I = Type::getDoubleTy(TheContext);
-    VectorType* vectorType = VectorType::get(I, 128);
+AllocaInst *CreateEntryBlockAllocaArrayDescriptor(Function *TheFunction, const string &VarName, Type *elem) {
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(vectorType, 0, VarName.c_str());
+    return TmpB.CreateAlloca(ArrayDescriptorType(elem), 0, VarName.c_str());
+}
+
+/* Arrays are kept as { element*, i32 length } descriptors; the elements live
+   in an entry block alloca or, for long and runtime sized seq results, in a
+   heap buffer */
+StructType *ArrayDescriptorType(Type *elem) {
+    return StructType::get(*TheContext, {PointerType::getUnqual(elem), Type::getInt32Ty(*TheContext)});
+}
+
+bool IsArrayDescriptor(Type *t) {
+    StructType* st = dyn_cast<StructType>(t);
+    return st and st->getNumElements() == 2 and st->getElementType(0)->isPointerTy();
+}
+
+/* Returns the descriptor of array id in f, a new one if it doesn't exist or
+   held another element type */
+AllocaInst *GetArrayDescriptor(Function *TheFunction, symbol id, Type *elem) {
+    AllocaInst* alloca = NamedValues.lookup(id);
+    if(!alloca or alloca->getAllocatedType() != ArrayDescriptorType(elem)) {
+        alloca = CreateEntryBlockAllocaArrayDescriptor(TheFunction, SymbolName(id), elem);
+        NamedValues.set(id, alloca);
+    }
+    return alloca;
+}
+
+void StoreArrayDescriptor(AllocaInst *desc, Value *data, Value *length) {
+    Builder->CreateStore(data, Builder->CreateStructGEP(desc, 0));
+    Builder->CreateStore(length, Builder->CreateStructGEP(desc, 1));
+}
+
+Value *ArrayStorageData(AllocaInst *storage) {
+    vector<Value*> s;
+    s.push_back(ConstantInt::get(*TheContext, APInt(32, 0)));
+    s.push_back(ConstantInt::get(*TheContext, APInt(32, 0)));
+    return Builder->CreateGEP(storage, s);
+}
+
+Value *ArrayDescriptorData(AllocaInst *desc) {
+    return Builder->CreateLoad(Builder->CreateStructGEP(desc, 0), "data");
+}
+
+Value *ArrayDescriptorLength(AllocaInst *desc) {
+    return Builder->CreateLoad(Builder->CreateStructGEP(desc, 1), "length");
+}
+
+bool VariableNode::indexRange(IndexRange &range) const {
+    range = CounterRanges.lookup(id_);
+    return range.lo != nullptr;
+}
+
+bool IntNode::indexRange(IndexRange &range) const {
+    range = IndexRange();
+    range.lo = range.hi = ConstantInt::get(Type::getInt64Ty(*TheContext), num_, true);
+    range.narrow = !isLong();
+    return true;
+}
+
+/* Sums and differences of one counter and literals. Their ends are
+   computed exactly in i64; when they are valid indices, no value in between
+   wrapped around in the int arithmetic of the index itself */
+bool BinaryOperatorNode::indexRange(IndexRange &range) const {
+    if(op_ != bin_op::plus and op_ != bin_op::minus)
+        return false;
+    IndexRange l, r;
+    if(!l_->indexRange(l) or !r_->indexRange(r))
+        return false;
+    if((l.body and r.body) or !l.narrow or !r.narrow)
+        return false;
+
+    range = l.body ? l : r;
+    IRBuilder<> B(*TheContext);
+    if(range.preheader)
+        B.SetInsertPoint(range.preheader->getTerminator());
+    if(op_ == bin_op::plus) {
+        range.lo = B.CreateAdd(l.lo, r.lo);
+        range.hi = B.CreateAdd(l.hi, r.hi);
+    }
+    else {
+        range.lo = B.CreateSub(l.lo, r.hi);
+        range.hi = B.CreateSub(l.hi, r.lo);
+    }
+    return true;
+}
+
+/* Length of array id wherever it can be accessed: it's assigned once in
+   the function, with a constant length */
+static ConstantInt *KnownLength(symbol id) {
+    if(CurrentBody->assignments(id) != 1)
+        return nullptr;
+    return dyn_cast_or_null<ConstantInt>(ArrayLengths.lookup(id));
+}
+
+/* Traps unless 0 <= index < length. Constant ranges within a known length
+   need no check. For an index depending on a for counter, whether its whole
+   range is valid is computed once before the loop, if the loop doesn't
+   assign the array; the copy of the loop run when it is has no check of
+   the index at all, the other one checks every access */
+static void CreateBoundsCheck(symbol id, AllocaInst *desc, Value *index, const ExpressionNode *e) {
+    Type* i64 = Type::getInt64Ty(*TheContext);
+    IndexRange range;
+    bool ranged = e->indexRange(range) and !(range.body and range.body->assignments(id));
+    if(ranged) {
+        ConstantInt* lo = dyn_cast<ConstantInt>(range.lo);
+        ConstantInt* hi = dyn_cast<ConstantInt>(range.hi);
+        ConstantInt* length = KnownLength(id);
+        if(lo and hi and length and lo->getSExtValue() >= 0 and hi->getSExtValue() < length->getSExtValue())
+            return;
+    }
+
+    if(ranged and range.preheader) {
+        if(!range.checks)
+            return;
+        IRBuilder<> PB(range.preheader->getTerminator());
+        Value* pre_length = PB.CreateZExt(PB.CreateLoad(PB.CreateStructGEP(desc, 1)), i64);
+        range.checks->push_back(PB.CreateAnd(PB.CreateICmpSGE(range.lo, ConstantInt::get(i64, 0)), PB.CreateICmpSLT(range.hi, pre_length), "rangeinbounds"));
+    }
+
+    Value* length = Builder->CreateZExt(ArrayDescriptorLength(desc), i64);
+    CreateTrapUnless(Builder->CreateICmpULT(Builder->CreateSExt(index, i64), length, "inbounds"), "inbounds");
+}
+
+/* Pointer to element index of array id, e being the index expression */
+Value *CreateArrayElementPtr(symbol id, Value *index, const ExpressionNode *e) {
+    AllocaInst* desc = NamedValues.lookup(id);
+    if(!desc or !IsArrayDescriptor(desc->getAllocatedType()))
+        ReportError("Not an array: " + SymbolName(id));
+    if(index->getType()->isFloatingPointTy())
+        index = Builder->CreateFPToSI(index, Type::getInt32Ty(*TheContext));
+    if(CheckBounds)
+        CreateBoundsCheck(id, desc, index, e);
+
+    return Builder->CreateGEP(ArrayDescriptorData(desc), index);
+}
+
+/* Heap buffer of array id in f: the slot starts out null, is resized with
+   realloc by every (re)assignment and freed when f returns */
+AllocaInst *GetHeapSlot(Function *TheFunction, symbol id) {
+    AllocaInst* slot = HeapSlots.lookup(id);
+    if(!slot) {
+        IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+        slot = TmpB.CreateAlloca(Type::getInt8PtrTy(*TheContext), 0, (SymbolName(id) + ".heap").c_str());
+        TmpB.CreateStore(ConstantPointerNull::get(Type::getInt8PtrTy(*TheContext)), slot);
+        HeapSlots.set(id, slot);
+        HeapSlotList.push_back(slot);
+    }
+    return slot;
+}
+
+Value *CreateHeapArray(Function *TheFunction, symbol id, Type *elem, Value *length) {
+    AllocaInst* slot = GetHeapSlot(TheFunction, id);
+    Value* size = ConstantInt::get(*TheContext, APInt(64, TheModule->getDataLayout().getTypeAllocSize(elem)));
+    Value* bytes = Builder->CreateMul(Builder->CreateZExt(length, Type::getInt64Ty(*TheContext)), size);
+    Value* mem = CreateCheckedRealloc(Builder->CreateLoad(slot), bytes);
+    Builder->CreateStore(mem, slot);
+    return Builder->CreateBitCast(mem, PointerType::getUnqual(elem));
+}
+
+/* Continues in a new block named name when ok holds, traps otherwise */
+void CreateTrapUnless(Value *ok, const Twine &name) {
+    Function *f = Builder->GetInsertBlock()->getParent();
+    BasicBlock *okBB = BasicBlock::Create(*TheContext, name, f);
+    BasicBlock *trapBB = BasicBlock::Create(*TheContext, "trap", f);
+    Builder->CreateCondBr(ok, okBB, trapBB, MDBuilder(*TheContext).createBranchWeights(1 << 20, 1));
+
+    Builder->SetInsertPoint(trapBB);
+    Builder->CreateCall(Intrinsic::getDeclaration(TheModule, Intrinsic::trap));
+    Builder->CreateUnreachable();
+    Builder->SetInsertPoint(okBB);
+}
+
+/* realloc(ptr, bytes), trapping when it fails instead of handing out a null
+   buffer; null is only a valid result for 0 bytes */
+Value *CreateCheckedRealloc(Value *ptr, Value *bytes) {
+    Value* mem = Builder->CreateCall(Realloc, {ptr, bytes}, "heaparray");
+    Value* zero = ConstantInt::get(bytes->getType(), 0);
+    CreateTrapUnless(Builder->CreateOr(Builder->CreateIsNotNull(mem), Builder->CreateICmpEQ(bytes, zero)), "allocated");
+    return mem;
+}
+
+/* Lanes of elem in a vector register of the target, at least 2 */
+unsigned VectorWidth(Type *elem) {
+    Function *f = Builder->GetInsertBlock()->getParent();
+    unsigned bits = TheTargetMachine->getTargetTransformInfo(*f).getRegisterBitWidth(true);
+    unsigned width = bits / elem->getPrimitiveSizeInBits();
+    return width < 2 ? 2 : width;
+}
+
+/* Emits for(i = begin; i < end; i += step) body(i); end - begin has to be a
+   multiple of step. Loop carried values start as init, body gets their
+   current values and returns the next ones, the final ones are returned */
+vector<Value*> CreateCountedLoop(Value *begin, Value *end, unsigned step, const vector<Value*> &init, const function<vector<Value*>(Value*, const vector<Value*>&)> &body) {
+    Function *f = Builder->GetInsertBlock()->getParent();
+    BasicBlock *pre_BB = Builder->GetInsertBlock();
+    BasicBlock *loop_BB = BasicBlock::Create(*TheContext, "loop", f);
+    BasicBlock *after_loop_BB = BasicBlock::Create(*TheContext, "afterloop", f);
+    Builder->CreateCondBr(Builder->CreateICmpSLT(begin, end), loop_BB, after_loop_BB);
+
+    Builder->SetInsertPoint(loop_BB);
+    PHINode* idx = Builder->CreatePHI(Type::getInt32Ty(*TheContext), 2, "idx");
+    idx->addIncoming(begin, pre_BB);
+    vector<PHINode*> phis;
+    for(auto &val: init) {
+        phis.push_back(Builder->CreatePHI(val->getType(), 2, "acc"));
+        phis.back()->addIncoming(val, pre_BB);
+    }
+
+    vector<Value*> next_vals = body(idx, vector<Value*>(phis.begin(), phis.end()));
+
+    Value* next = Builder->CreateAdd(idx, ConstantInt::get(*TheContext, APInt(32, step)), "nextidx");
+    BasicBlock *latch_BB = Builder->GetInsertBlock();
+    idx->addIncoming(next, latch_BB);
+    for(unsigned i = 0; i < phis.size(); i++)
+        phis[i]->addIncoming(next_vals[i], latch_BB);
+    Builder->CreateCondBr(Builder->CreateICmpSLT(next, end), loop_BB, after_loop_BB);
+
+    Builder->SetInsertPoint(after_loop_BB);
+    vector<Value*> result;
+    for(unsigned i = 0; i < init.size(); i++) {
+        PHINode* phi = Builder->CreatePHI(init[i]->getType(), 2, "acc");
+        phi->addIncoming(init[i], pre_BB);
+        phi->addIncoming(next_vals[i], latch_BB);
+        result.push_back(phi);
+    }
+    return result;
+}
+
+void CreateCountedLoop(Value *begin, Value *end, unsigned step, const function<void(Value*)> &body) {
+    CreateCountedLoop(begin, end, step, {}, [&](Value* idx, const vector<Value*>&) {
+        body(idx);
+        return vector<Value*>();
+    });
+}
+
+/* Runs body(i, width) over the largest multiple of width (a power of two)
+   below length, then body(i, 1) over the remainder */
+void CreateVectorLoop(Value *length, unsigned width, const function<void(Value*, unsigned)> &body) {
+    Value* zero = ConstantInt::get(*TheContext, APInt(32, 0));
+    Value* vec_end = Builder->CreateAnd(length, ConstantInt::get(*TheContext, APInt(32, -(int64_t)width, true)), "vecend");
+    CreateCountedLoop(zero, vec_end, width, [&](Value* idx) { body(idx, width); });
+    CreateCountedLoop(vec_end, length, 1, [&](Value* idx) { body(idx, 1); });
+}
+
+/* double f.entry(double *args) calls f with the arguments converted to its
+   parameter types and returns the result as a double, so the interpreter
+   can call compiled functions of any signature */
+Function *CreateEntryThunk(Function *f) {
+    Type* dbl = Type::getDoubleTy(*TheContext);
+    FunctionType* ft = FunctionType::get(dbl, PointerType::getUnqual(dbl), false);
+    Function* thunk = Function::Create(ft, Function::ExternalLinkage, f->getName() + ".entry", TheModule);
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", thunk));
+
+    Type* i64 = Type::getInt64Ty(*TheContext);
+    Value* args = thunk->arg_begin();
+    vector<Value*> a;
+    for(auto &arg: f->args()) {
+        Value* ptr = Builder->CreateGEP(args, ConstantInt::get(*TheContext, APInt(32, arg.getArgNo())));
+        if(arg.getType() == i64)
+            a.push_back(Builder->CreateLoad(Builder->CreateBitCast(ptr, PointerType::getUnqual(i64))));
+        else
+            a.push_back(ConvertScalar(Builder->CreateLoad(ptr), arg.getType()));
+    }
+    Value* val = Builder->CreateCall(f, a, "calltmp");
+    Builder->CreateRet(val->getType() == i64 ? Builder->CreateBitCast(val, dbl) : ConvertScalar(val, dbl));
+    return thunk;
+}
+
+/* return(val): stores val, converted to the return type, and branches to
+   the return block */
+void CreateReturn(Value *val) {
+    Builder->CreateStore(ConvertScalar(val, ReturnSlot->getAllocatedType()), ReturnSlot);
+    Builder->CreateBr(ReturnBlock);
+}
+
+/* Frees the heap arrays of the current function and returns val */
+Value *CreateFunctionReturn(Value *val) {
+    for(AllocaInst* slot: HeapSlotList)
+        Builder->CreateCall(Free, Builder->CreateLoad(slot));
+    return Builder->CreateRet(val);
 }
@@ -3,18 +3,36 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <map>
+#include <functional>
 #include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <memory>
 
+#include "error.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Pass.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
 
 using namespace std;
@@ -37,48 +55,332 @@ enum class bin_op {
 	and_
 };
 
-/* Types */
+/* Reductions over arrays */
+enum class red_op {
+	sum,
+	mean,
+	min,
+	max,
+	prod
+};
+
+/* Types, ordered so that merging two types takes the larger one. int is
+   i32, long i64 and float f32; arrays come in the same order as their
+   elements */
 enum class my_type {
 	int_,
-	double_
+	long_,
+	float_,
+	double_,
+	int_array,
+	long_array,
+	float_array,
+	double_array
+};
+
+/* Inferred types of the variables of a function */
+/* Identifiers are interned by the lexer, nodes refer to them by number */
+typedef unsigned symbol;
+symbol Intern(StringRef name);
+const string &SymbolName(symbol s);
+
+typedef map<symbol, my_type> TypeEnv;
+
+/* Flat table from symbols to values for the function being generated.
+   Nested scopes (for loop variables) remember what they shadow and put it
+   back when left. The table keeps its size between functions and clearing
+   only resets the entries that were set, so a function costs what it uses
+   rather than the number of symbols in the program */
+template<typename T>
+class ScopeTable {
+public:
+	T lookup(symbol s) const {
+		return s < values_.size() ? values_[s] : T();
+	}
+	void set(symbol s, T val) {
+		if(s >= values_.size())
+			values_.resize(s + 1);
+		values_[s] = val;
+		used_.push_back(s);
+	}
+	void define(symbol s, T val) {
+		shadowed_.push_back({s, lookup(s)});
+		set(s, val);
+	}
+	void enterScope() {
+		scopes_.push_back(shadowed_.size());
+	}
+	void leaveScope() {
+		for(; shadowed_.size() > scopes_.back(); shadowed_.pop_back())
+			set(shadowed_.back().first, shadowed_.back().second);
+		scopes_.pop_back();
+	}
+	void clear() {
+		for(symbol s: used_)
+			values_[s] = T();
+		used_.clear();
+		shadowed_.clear();
+		scopes_.clear();
+	}
+private:
+	vector<T> values_;
+	vector<symbol> used_;
+	vector<pair<symbol, T>> shadowed_;
+	vector<size_t> scopes_;
+};
+
+/* The AST of one compilation and its interned identifiers. Nodes and their
+   lists are bump allocated from the arena and never freed one by one, the
+   whole tree goes away with it. Parsing uses the AstContext of its thread,
+   -j workers share the one of the thread that started them */
+struct AstContext {
+	BumpPtrAllocator arena;
+	StringMap<symbol> symbols;
+	deque<string> names;
+};
+extern thread_local AstContext *TheAst;
+
+class ArenaNode {
+public:
+	void *operator new(size_t size) {
+		return TheAst->arena.Allocate(size, alignof(max_align_t));
+	}
+	void operator delete(void *) {}
+};
+
+/* Copies a list into the arena */
+template<typename T>
+ArrayRef<T> CopyToArena(const vector<T> &v) {
+	T *data = TheAst->arena.Allocate<T>(v.size());
+	uninitialized_copy(v.begin(), v.end(), data);
+	return ArrayRef<T>(data, v.size());
+}
+
+/* A list the parser grows in the arena and nodes keep as an ArrayRef.
+   Growing copies it to twice the room; the block it leaves is only
+   freed with the arena, which costs less than a heap vector per list */
+template<typename T>
+class ArenaList: public ArenaNode {
+public:
+	void push_back(const T &v) {
+		if(size_ == capacity_) {
+			capacity_ = capacity_ ? 2*capacity_ : 4;
+			T *data = TheAst->arena.Allocate<T>(capacity_);
+			uninitialized_copy(data_, data_ + size_, data);
+			data_ = data;
+		}
+		new(data_ + size_++) T(v);
+	}
+	operator ArrayRef<T>() const {
+		return ArrayRef<T>(data_, size_);
+	}
+private:
+	T *data_ = nullptr;
+	size_t size_ = 0;
+	size_t capacity_ = 0;
+};
+
+/* Kinds of AST nodes, used by codegen tracing and statistics */
+enum class node_kind {
+	variable,
+	int_,
+	double_,
+	assignment,
+	array_assignment,
+	access_array,
+	modify_array,
+	sequence,
+	binary_operator,
+	return_,
+	block,
+	print,
+	empty,
+	function_call,
+	if_else,
+	for_loop,
+	while_,
+	reduction,
+	function_prototype,
+	function,
+	program
+};
+const unsigned NodeKindCount = (unsigned)node_kind::program + 1;
+
+extern bool TraceCodegen;
+extern thread_local bool CheckBounds;
+/* Generated nodes by kind, counted by each thread on its own and added to
+   NodeCounts by FlushNodeCounts, so -j threads don't share cache lines */
+extern thread_local unsigned ThreadNodeCounts[NodeKindCount];
+extern atomic<unsigned> NodeCounts[NodeKindCount];
+void TraceNode(node_kind kind);
+void FlushNodeCounts();
+void PrintNodeCounts();
+
+/* Codegen tracing: builds with -DCROMPILER_TRACE can log every node with
+   --trace-codegen, other builds only bump the thread's per-kind counter */
+#ifdef CROMPILER_TRACE
+#define TRACE_NODE(kind) TraceNode(node_kind::kind)
+#else
+#define TRACE_NODE(kind) (ThreadNodeCounts[(unsigned)node_kind::kind]++)
+#endif
+
+class ExpressionNode;
+class FunctionNode;
+
+/* Range of an index expression for bounds checks, as i64 values: constant
+   for literals, computed before the loop for the counter of a for loop
+   (body and preheader are null for constants) */
+struct IndexRange {
+	Value *lo = nullptr;
+	Value *hi = nullptr;
+	const ExpressionNode *body = nullptr;
+	BasicBlock *preheader = nullptr;
+	/* The counter is an int, so counter +- literal can't overflow an i64 */
+	bool narrow = true;
+	/* Whole range checks made in the preheader, null in the copy of the
+	   loop that only runs when all of them hold */
+	vector<Value*> *checks = nullptr;
+};
+
+/* Value of an expression in the interpreter, with the type generated code
+   would give it. Arrays are shared until assigned, which copies them;
+   elements of int arrays are whole numbers */
+struct EvalValue {
+	my_type type = my_type::int_;
+	bool valid = false;
+	int64_t i = 0;
+	double d = 0;
+	shared_ptr<vector<double>> elements;
+};
+
+/* Compiled function called by the interpreter: arguments and result are
+   passed as doubles, longs as their bits */
+typedef double (*NativeFunction)(const double *args);
+/* Compiles hot functions for the interpreter, returning their entries */
+typedef function<vector<NativeFunction>(ArrayRef<const FunctionNode*>)> TierUp;
+
+/* Structural hash of ASTs for fingerprints. Identifiers go in by name;
+   called functions are also collected, so that the fingerprint of a
+   function can cover their signatures */
+class NodeHasher {
+public:
+	void add(node_kind kind) {
+		addInt((uint64_t)kind);
+	}
+	void addInt(uint64_t v);
+	void addDouble(double v);
+	void addString(StringRef s);
+	void addSymbol(symbol s) {
+		addString(SymbolName(s));
+	}
+	void addNodes(ArrayRef<ExpressionNode*> ve);
+	void addCall(symbol s);
+	ArrayRef<symbol> calls() const {
+		return calls_;
+	}
+	string final();
+private:
+	SHA1 sha_;
+	vector<symbol> calls_;
 };
 
 /* Node holding any expression */
-class ExpressionNode {
+class ExpressionNode: public ArenaNode {
 public:
 	virtual ~ExpressionNode() {}
 	virtual Value* codegen() const = 0;
+	virtual void hash(NodeHasher &h) const = 0;
+	/* Interprets the node in the running call's locals */
+	virtual EvalValue eval() const = 0;
+	/* Interprets return(e) for this e like returngen generates it: the
+	   value goes to ReturnValue, calls of the running function itself
+	   start it over */
+	virtual void returneval() const;
+
+	/* Generates return(e) for this e: the value goes to the function's
+	   return block, calls of the function itself become jumps */
+	virtual Value* returngen() const;
+	virtual bool isCallTo(symbol function) const { return false; }
+
+	/* Cheap and without side effects, so it may be evaluated when its
+	   value isn't needed (both sides of a select) */
+	virtual bool isSimple() const { return false; }
+	/* A statement just setting a scalar to a simple value: x = a + 1 */
+	virtual bool isSimpleAssignment(symbol &id, const ExpressionNode *&value) const { return false; }
+	virtual bool isEmpty() const { return false; }
+	/* Every path through the statement ends in a return; code after it is
+	   never reached */
+	virtual bool alwaysReturns() const { return false; }
+	/* Number of statements assigning variable id */
+	virtual unsigned assignments(symbol id) const { return 0; }
+	/* Range of the value as an array index, false when unknown */
+	virtual bool indexRange(IndexRange &range) const { return false; }
+
+	/* Static type of the value, given the types of the variables */
+	virtual my_type type(const TypeEnv& env) const { return my_type::int_; }
+	/* Records the types of the variables assigned by the statement */
+	virtual void inferTypes(TypeEnv& env) const {}
+
+	/* Element-wise array expressions (c <- a + b * 2) are generated as one
+	   loop: hoist() evaluates scalar operands and array data pointers before
+	   it, elementgen() then yields width elements starting at idx */
+	virtual bool isArray() const { return false; }
+	virtual void hoist() const;
+	virtual Type* elementType() const;
+	virtual Value* elementgen(Value* idx, unsigned width) const;
+	virtual Value* lengthgen() const { return nullptr; }
 };
 
 /* Node handling variables in expressions */
 class VariableNode: public ExpressionNode {
 public:
-	VariableNode(string id)
+	VariableNode(symbol id)
 		: id_(id)
 	{}
     Value* codegen() const;
+    void hash(NodeHasher &h) const;
+    EvalValue eval() const;
+    bool isSimple() const;
+	bool isArray() const;
+	void hoist() const;
+	Type* elementType() const;
+	Value* elementgen(Value* idx, unsigned width) const;
+	Value* lengthgen() const;
+	my_type type(const TypeEnv& env) const;
+	bool indexRange(IndexRange &range) const;
 private:
-	string id_;
+	symbol id_;
 };
 
 /* Node handling int literals in expressions */
 class IntNode: public ExpressionNode {
 public:
-    IntNode(int num)
+    IntNode(int64_t num)
 		: num_(num)
 	{}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool isSimple() const { return true; }
+	my_type type(const TypeEnv& env) const;
+	bool indexRange(IndexRange &range) const;
 private:
-	int num_;
+	/* Literals that don't fit in an int are longs */
+	bool isLong() const { return num_ != (int32_t)num_; }
+	int64_t num_;
 };
 
 /* Node handling double literals in expressions */
 class DoubleNode: public ExpressionNode {
 public:
-    DoubleNode(float num)
+    DoubleNode(double num)
 		: num_(num)
 	{}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool isSimple() const { return true; }
+	my_type type(const TypeEnv& env) const;
 private:
  	double num_;
 };
@@ -86,62 +388,65 @@ private:
 /* Node handling literal assignments */
 class AssignmentNode: public ExpressionNode {
 public:
-    AssignmentNode(string id, ExpressionNode* e)
+    AssignmentNode(symbol id, ExpressionNode* e)
         : id_(id), e_(e)
     {}
-	~AssignmentNode() {
-		delete e_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool isSimpleAssignment(symbol &id, const ExpressionNode *&value) const;
+	unsigned assignments(symbol id) const { return id == id_; }
+	my_type type(const TypeEnv& env) const;
+	void inferTypes(TypeEnv& env) const;
 private:
-	string id_;
+	Value* CreateElementwiseAssignment() const;
+	symbol id_;
     ExpressionNode* e_;
 };
 
 /* Node handling array assignments */
 class ArrayAssignmentNode: public ExpressionNode {
 public:
-    ArrayAssignmentNode(string id, vector<ExpressionNode*> ve)
+    ArrayAssignmentNode(symbol id, ArrayRef<ExpressionNode*> ve)
         : id_(id), ve_(ve)
     {}
-	~ArrayAssignmentNode() {
-		for(auto &e: ve_)
-			delete e;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	unsigned assignments(symbol id) const { return id == id_; }
+	void inferTypes(TypeEnv& env) const;
 private:
-	string id_;
-    vector<ExpressionNode*> ve_;
+	symbol id_;
+    ArrayRef<ExpressionNode*> ve_;
 };
 
 /* Node handling array accessing */
 class AccessArrayNode: public ExpressionNode {
 public:
-    AccessArrayNode(string id, ExpressionNode* e)
+    AccessArrayNode(symbol id, ExpressionNode* e)
         : id_(id), e_(e)
     {}
-	~AccessArrayNode() {
-		delete e_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	my_type type(const TypeEnv& env) const;
 private:
-	string id_;
+	symbol id_;
     ExpressionNode* e_;
 };
 
 /* Node handling modification of its elements */
 class ModifyArrayNode: public ExpressionNode {
 public:
-    ModifyArrayNode(string id, ExpressionNode* e1, ExpressionNode* e2)
+    ModifyArrayNode(symbol id, ExpressionNode* e1, ExpressionNode* e2)
         : id_(id), e1_(e1), e2_(e2)
     {}
-	~ModifyArrayNode() {
-		delete e1_;
-		delete e2_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	my_type type(const TypeEnv& env) const;
 private:
-	string id_;
+	symbol id_;
 	ExpressionNode* e1_;
 	ExpressionNode* e2_;
 };
@@ -152,12 +457,21 @@ public:
     BinaryOperatorNode(bin_op op, ExpressionNode* l, ExpressionNode* r)
         : op_(op), l_(l), r_(r)
     {}
-	~BinaryOperatorNode() {
-		delete l_;
-		delete r_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	void returneval() const;
+	bool isSimple() const;
+	Value* returngen() const;
+	bool isArray() const;
+	void hoist() const;
+	Type* elementType() const;
+	Value* elementgen(Value* idx, unsigned width) const;
+	Value* lengthgen() const;
+	my_type type(const TypeEnv& env) const;
+	bool indexRange(IndexRange &range) const;
 private:
+	Value* CreateLogicalOperator() const;
     bin_op op_;
     ExpressionNode* l_;
     ExpressionNode* r_;
@@ -169,10 +483,12 @@ public:
 	ReturnNode(ExpressionNode* e)
 		: e_(e)
 	{}
-	~ReturnNode() {
-		delete e_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool alwaysReturns() const { return true; }
+	my_type type(const TypeEnv& env) const;
+	void inferTypes(TypeEnv& env) const;
 private:
 	ExpressionNode* e_;
 };
@@ -180,16 +496,19 @@ private:
 /* Node handling multiple statements in a block */
 class BlockNode: public ExpressionNode {
 public:
-	BlockNode(vector<ExpressionNode*> ve)
+	BlockNode(ArrayRef<ExpressionNode*> ve)
 		: statements_(ve)
 	{}
-	~BlockNode() {
-		for(auto &e: statements_)
-			delete e;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool isSimpleAssignment(symbol &id, const ExpressionNode *&value) const;
+	bool alwaysReturns() const;
+	unsigned assignments(symbol id) const;
+	my_type type(const TypeEnv& env) const;
+	void inferTypes(TypeEnv& env) const;
 private:
-	vector<ExpressionNode*> statements_;
+	ArrayRef<ExpressionNode*> statements_;
 };
 
 /* Node handling print function */
@@ -198,10 +517,10 @@ public:
 	PrintNode(ExpressionNode* e)
 		: e_(e)
 	{}
-	~PrintNode() {
-		delete e_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	my_type type(const TypeEnv& env) const;
 private:
 	ExpressionNode *e_;
 };
@@ -211,55 +530,83 @@ class EmptyNode: public ExpressionNode {
 public:
 	EmptyNode() {}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool isEmpty() const { return true; }
 };
 
 /* Node handling function calls */
 class FunctionCallNode: public ExpressionNode {
 public:
-	FunctionCallNode(string id, vector<ExpressionNode*> ve)
+	FunctionCallNode(symbol id, ArrayRef<ExpressionNode*> ve)
 		: id_(id), params_(ve)
 	{}
-	~FunctionCallNode() {
-		for(auto &e: params_)
-			delete e;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	void returneval() const;
+	Value* returngen() const;
+	bool isCallTo(symbol function) const {
+		return id_ == function;
+	}
+	void tailcallgen() const;
+	vector<EvalValue> evalArgs() const;
+	my_type type(const TypeEnv& env) const;
 private:
-	string id_;
-	vector<ExpressionNode*> params_;
+	symbol id_;
+	ArrayRef<ExpressionNode*> params_;
 };
 
 /* Node handling call to seq function */
 class SequenceNode: public ExpressionNode {
 public:
-	SequenceNode(string id, ExpressionNode* e1, ExpressionNode* e2, ExpressionNode* e3)
+	SequenceNode(symbol id, ExpressionNode* e1, ExpressionNode* e2, ExpressionNode* e3)
 		: id_(id), start_(e1), end_(e2), step_(e3)
 	{}
-	~SequenceNode() {
-		delete start_;
-		delete end_;
-		delete step_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	unsigned assignments(symbol id) const { return id == id_; }
+	void inferTypes(TypeEnv& env) const;
+	my_type sequenceType(const TypeEnv& env) const;
 private:
-	string id_;
+	symbol id_;
 	ExpressionNode* start_;
 	ExpressionNode* end_;
 	ExpressionNode* step_;
 };
 
+/* Node handling sum, mean, min, max and prod of arrays, dot(a, b) is
+   sum(a * b) */
+class ReductionNode: public ExpressionNode {
+public:
+	ReductionNode(red_op op, ExpressionNode* e)
+		: op_(op), e_(e)
+	{}
+	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	my_type type(const TypeEnv& env) const;
+private:
+	red_op op_;
+	ExpressionNode* e_;
+};
+
 /* Node handling if-else blocks */
 class IfElseNode: public ExpressionNode {
 public:
    IfElseNode(ExpressionNode* e1, ExpressionNode* e2, ExpressionNode* e3)
        : cond_(e1), then_(e2), else_(e3)
    {}
-   ~IfElseNode() {
-	   delete cond_;
-	   delete then_;
-	   delete else_;
-   }
    Value* codegen() const;
+   void hash(NodeHasher &h) const;
+   EvalValue eval() const;
+	bool alwaysReturns() const;
+	unsigned assignments(symbol id) const {
+		return then_->assignments(id) + else_->assignments(id);
+	}
+	my_type type(const TypeEnv& env) const;
+	void inferTypes(TypeEnv& env) const;
 private:
    ExpressionNode *cond_;
    ExpressionNode *then_;
@@ -269,17 +616,20 @@ private:
 /* Node handling for loops */
 class ForLoopNode: public ExpressionNode {
 public:
-	ForLoopNode(string id, ExpressionNode* e1, ExpressionNode* e2, ExpressionNode* e3)
+	ForLoopNode(symbol id, ExpressionNode* e1, ExpressionNode* e2, ExpressionNode* e3)
 		: id_(id), start_(e1), end_(e2), body_(e3)
 	{}
-	~ForLoopNode() {
-		delete start_;
-		delete end_;
-		delete body_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	bool alwaysReturns() const;
+	unsigned assignments(symbol id) const { return body_->assignments(id); }
+	void inferTypes(TypeEnv& env) const;
+	my_type counterType(const TypeEnv& env) const;
 private:
-	string id_;
+	Value* loopgen(BasicBlock *loop_BB, BasicBlock *pre_BB, AllocaInst *alloca, Value *start, Value *step,
+	               Value *last, const IndexRange &range, BasicBlock *after_BB, BasicBlock *&latch_BB) const;
+	symbol id_;
 	ExpressionNode *start_;
     ExpressionNode *end_;
     ExpressionNode *body_;
@@ -291,13 +641,12 @@ public:
 	WhileNode(ExpressionNode* e1, ExpressionNode* e2)
 		: cond_(e1), body_(e2)
 	{}
-	~WhileNode() {
-		delete cond_;
-		delete body_;
-	}
 	Value* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue eval() const;
+	unsigned assignments(symbol id) const { return body_->assignments(id); }
+	void inferTypes(TypeEnv& env) const;
 private:
-	string id_;
 	ExpressionNode *cond_;
     ExpressionNode *body_;
 };
@@ -305,37 +654,128 @@ private:
 /* Node handling function prototype */
 class FunctionPrototypeNode {
 public:
-    FunctionPrototypeNode(string id, vector<pair<my_type, string>> ve, my_type m)
+    FunctionPrototypeNode(symbol id, ArrayRef<pair<my_type, symbol>> ve, my_type m)
         : id_(id), params_(ve), ret_type_(m)
     {}
 	Function* codegen() const;
-	string getName() const {
-    	return id_;
+	const string &getName() const {
+    	return SymbolName(id_);
   	}
+	ArrayRef<pair<my_type, symbol>> getParams() const {
+		return params_;
+	}
+	symbol getId() const {
+		return id_;
+	}
+	my_type getReturnType() const {
+		return ret_type_;
+	}
+	void hashSignature(NodeHasher &h) const;
 private:
-    string id_;
-    vector<pair<my_type, string>> params_;
+    symbol id_;
+    ArrayRef<pair<my_type, symbol>> params_;
 	my_type ret_type_;
 };
 
 /* Node handling definition of function */
-class FunctionNode {
+class FunctionNode: public ArenaNode {
 public:
 	FunctionNode(FunctionPrototypeNode p, ExpressionNode* e)
 		: prototype_(p), body_(e)
 	{}
-	~FunctionNode() {
-		delete body_;
-	}
+	Function* declare() const;
+	void inferTypes() const;
 	Function* codegen() const;
+	void hash(NodeHasher &h) const;
+	EvalValue call(vector<EvalValue> args) const;
+	vector<symbol> callees() const;
+	const string &getName() const {
+		return prototype_.getName();
+	}
+	const FunctionPrototypeNode &getPrototype() const {
+		return prototype_;
+	}
 private:
 	FunctionPrototypeNode prototype_;
 	ExpressionNode* body_;
 };
 
-void InitializeModuleAndPassManager();
-AllocaInst *CreateEntryBlockAllocaInt(Function *TheFunction, const string &VarName);
-AllocaInst *CreateEntryBlockAllocaDouble(Function *TheFunction, const string &VarName);
-AllocaInst *CreateEntryBlockAllocaIntArray(Function *TheFunction, const string &VarName, unsigned size);
-AllocaInst *CreateEntryBlockAllocaDoubleArray(Function *TheFunction, const string &VarName, unsigned size);
-AllocaInst *CreateEntryBlockAllocaDoubleVector(Function * TheFunction, const string &VarName);
+/* Optimized bitcode of single functions by fingerprint */
+typedef StringMap<unique_ptr<MemoryBuffer>> FunctionCode;
+
+/* Fewest functions worth a -j thread of their own: a shard costs a context,
+   a target machine and a bitcode round trip, more than small scripts take
+   to generate on one thread */
+const unsigned MinFunctionsPerShard = 32;
+
+/* Node holding the whole program: every function definition, main included */
+class ProgramNode: public ArenaNode {
+public:
+	ProgramNode(ArrayRef<FunctionNode*> vf);
+	void codegen(unsigned begin, unsigned end, unsigned Jobs) const;
+	void codegen(unsigned begin, unsigned end, unsigned Jobs, FunctionCode &Code) const;
+	/* Hash of everything the code of function i depends on */
+	string fingerprint(unsigned i) const;
+	/* Runs main in the interpreter. Functions called or looping more than
+	   HotThreshold times are compiled with Compile, together with the
+	   functions they call, and run natively from their next call on */
+	int interpret(unsigned HotThreshold, const TierUp &Compile) const;
+	/* Generates the given functions with entries for the interpreter */
+	void generateEntries(ArrayRef<const FunctionNode*> functions) const;
+	/* The definition of function id, nullptr if there is none */
+	const FunctionNode *lookup(symbol id) const {
+		return id < definitions_.size() ? definitions_[id] : nullptr;
+	}
+private:
+	void generate(unsigned begin, unsigned end) const;
+	void link(ArrayRef<MemoryBufferRef> bitcode, unsigned begin, unsigned end) const;
+	ArrayRef<FunctionNode*> functions_;
+	ArrayRef<const FunctionNode*> definitions_;
+};
+
+my_type MergeTypes(my_type a, my_type b);
+bool IsArrayType(my_type t);
+my_type ArrayElementType(my_type t);
+my_type ArrayOf(my_type t);
+my_type TypeOf(Type *t);
+Type *ScalarType(my_type t);
+TypeEnv InferTypes(const ExpressionNode *body, TypeEnv env);
+void InferVariableTypes(Function *f, const ExpressionNode *body, TypeEnv env);
+unsigned SequenceLength(double start, double end, double step);
+Value *ConvertScalar(Value *val, Type *t);
+Value *CreateCondition(Value *val);
+Type *MergedType(Type *a, Type *b);
+BasicBlock *ReachableEnd(const ExpressionNode *e);
+void InitializeModuleAndPassManager(unsigned OptLevel, bool Checked, TargetMachine *TM);
+void FreeModuleAndPassManager();
+void InitializeModule();
+void FreeModule();
+Function *GetFunction(symbol id);
+void FinishFunction(Function *f);
+void OptimizeFunction(Function *f);
+void OptimizeModule();
+AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, const string &VarName, Type *t);
+AllocaInst *CreateEntryBlockAllocaArray(Function *TheFunction, const string &VarName, Type *elem, unsigned size);
+AllocaInst *CreateEntryBlockAllocaArrayDescriptor(Function *TheFunction, const string &VarName, Type *elem);
+StructType *ArrayDescriptorType(Type *elem);
+bool IsArrayDescriptor(Type *t);
+AllocaInst *GetArrayDescriptor(Function *TheFunction, symbol id, Type *elem);
+void StoreArrayDescriptor(AllocaInst *desc, Value *data, Value *length);
+Value *ArrayStorageData(AllocaInst *storage);
+Value *ArrayDescriptorData(AllocaInst *desc);
+Value *ArrayDescriptorLength(AllocaInst *desc);
+Value *CreateArrayElementPtr(symbol id, Value *index, const ExpressionNode *e);
+AllocaInst *GetHeapSlot(Function *TheFunction, symbol id);
+Value *CreateHeapArray(Function *TheFunction, symbol id, Type *elem, Value *length);
+void CreateTrapUnless(Value *ok, const Twine &name);
+Value *CreateCheckedRealloc(Value *ptr, Value *bytes);
+unsigned VectorWidth(Type *elem);
+vector<Value*> CreateCountedLoop(Value *begin, Value *end, unsigned step, const vector<Value*> &init, const function<vector<Value*>(Value*, const vector<Value*>&)> &body);
+void CreateCountedLoop(Value *begin, Value *end, unsigned step, const function<void(Value*)> &body);
+void CreateVectorLoop(Value *length, unsigned width, const function<void(Value*, unsigned)> &body);
+Value *CreateFunctionReturn(Value *val);
+void CreateReturn(Value *val);
+Function *CreateEntryThunk(Function *f);
+
+/* Longest constant seq() kept on the stack, longer ones go to the heap */
+const unsigned MaxStackSequence = 256;
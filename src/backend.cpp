@@ -0,0 +1,231 @@
+#include "backend.hpp"
+#include "stats.hpp"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <mutex>
+
+extern thread_local unique_ptr<LLVMContext> TheContext;
+extern thread_local unique_ptr<IRBuilder<>> Builder;
+extern thread_local Module* TheModule;
+extern thread_local TargetMachine *TheTargetMachine;
+extern thread_local unsigned TheOptLevel;
+extern thread_local llvm::legacy::FunctionPassManager *TheFPM;
+
+/* Errors of the JIT become CompileErrors like those of the sources */
+static void Check(Error E) {
+    if(E)
+        ReportError(toString(move(E)));
+}
+
+template<typename T>
+static T Check(Expected<T> E) {
+    if(!E)
+        ReportError(toString(E.takeError()));
+    return move(*E);
+}
+
+CodeGenOpt::Level GetCodeGenOptLevel(unsigned OptLevel) {
+    switch(OptLevel) {
+        case 0:
+            return CodeGenOpt::None;
+        case 1:
+            return CodeGenOpt::Less;
+        case 2:
+            return CodeGenOpt::Default;
+        default:
+            return CodeGenOpt::Aggressive;
+    }
+}
+
+/* Creates a machine for the host triple; CPU "native" selects the host CPU
+   and all of its features, extra features are given as "+avx2,-fma" */
+TargetMachine *CreateTargetMachine(const string &CPU, const string &Features, unsigned OptLevel) {
+    static std::once_flag Initialized;
+    std::call_once(Initialized, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+    });
+
+    string TargetTriple = sys::getDefaultTargetTriple();
+    string Error;
+    const Target *T = TargetRegistry::lookupTarget(TargetTriple, Error);
+    if(!T)
+        ReportError("Can't find target: " + Error);
+
+    string cpu = CPU.empty() ? "generic" : CPU;
+    string features = Features;
+    if(CPU == "native") {
+        cpu = sys::getHostCPUName();
+        SubtargetFeatures F;
+        StringMap<bool> HostFeatures;
+        if(sys::getHostCPUFeatures(HostFeatures))
+            for(auto &feature: HostFeatures)
+                F.AddFeature(feature.first(), feature.second);
+        if(!Features.empty())
+            F.AddFeature(Features);
+        features = F.getString();
+    }
+
+    return T->createTargetMachine(TargetTriple, cpu, features, TargetOptions(), Optional<Reloc::Model>(Reloc::PIC_), None, GetCodeGenOptLevel(OptLevel));
+}
+
+/* TargetMachines can't be shared between threads, every worker gets a copy */
+TargetMachine *CloneTargetMachine(TargetMachine *TM) {
+    return TM->getTarget().createTargetMachine(TM->getTargetTriple().str(), TM->getTargetCPU(), TM->getTargetFeatureString(), TM->Options, Optional<Reloc::Model>(Reloc::PIC_), None, TM->getOptLevel());
+}
+
+/* Writes TheModule as a native object file */
+void EmitObject(raw_pwrite_stream &dest) {
+    llvm::legacy::PassManager pass;
+    if(TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, CGFT_ObjectFile))
+        ReportError("Target can't emit an object file");
+    pass.run(*TheModule);
+}
+
+void EmitObjectFile(const string &Filename) {
+    error_code EC;
+    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+    if(EC)
+        ReportError("Can't open file " + Filename + ": " + EC.message());
+    EmitObject(dest);
+    dest.flush();
+}
+
+static string CreateTemporaryObject() {
+    SmallString<128> Object;
+    if(sys::fs::createTemporaryFile("r", "o", Object))
+        ReportError("Can't create a temporary object file");
+    return Object.str().str();
+}
+
+/* Emits TheModule as temporary object files for LinkExecutable. With more
+   than one job the module is split into up to Jobs partitions of at least
+   MinFunctionsPerShard functions (consuming TheModule) and every partition
+   is emitted on its own thread and context */
+vector<string> EmitObjectFiles(unsigned Jobs) {
+    Jobs = min(Jobs, (unsigned)TheModule->size() / MinFunctionsPerShard);
+    if(Jobs <= 1) {
+        string Object = CreateTemporaryObject();
+        EmitObjectFile(Object);
+        return {Object};
+    }
+
+    vector<SmallVector<char, 0>> Parts;
+    SplitModule(unique_ptr<Module>(TheModule), Jobs, [&](unique_ptr<Module> Part) {
+        Parts.emplace_back();
+        raw_svector_ostream os(Parts.back());
+        WriteBitcodeToFile(*Part, os);
+    });
+    TheModule = nullptr;
+
+    vector<string> Objects;
+    for(unsigned i = 0; i < Parts.size(); i++)
+        Objects.push_back(CreateTemporaryObject());
+
+    TargetMachine *TM = TheTargetMachine;
+    WorkerErrors Errors;
+    ThreadPool Pool(Parts.size());
+    for(unsigned i = 0; i < Parts.size(); i++)
+        Pool.async([&, i] {
+            TheContext = make_unique<LLVMContext>();
+            TheTargetMachine = CloneTargetMachine(TM);
+            try {
+                auto Part = parseBitcodeFile(MemoryBufferRef(StringRef(Parts[i].data(), Parts[i].size()), "part"), *TheContext);
+                if(!Part)
+                    ReportError("Can't read module partition: " + toString(Part.takeError()));
+                TheModule = Part->release();
+                EmitObjectFile(Objects[i]);
+            }
+            catch(const CompileError &e) {
+                Errors.add(e);
+            }
+            FreeModuleAndPassManager();
+        });
+    Pool.wait();
+    if(Errors.failed())
+        for(auto &Object: Objects)
+            sys::fs::remove(Object);
+    Errors.rethrow();
+    return Objects;
+}
+
+/* Links object files into an executable with the system C compiler */
+void LinkExecutable(const vector<string> &Objects, const string &Output) {
+    auto CC = sys::findProgramByName("cc");
+    if(!CC)
+        ReportError("Can't find cc to link " + Output);
+
+    string Error;
+    vector<StringRef> Args = {*CC};
+    Args.insert(Args.end(), Objects.begin(), Objects.end());
+    Args.push_back("-o");
+    Args.push_back(Output);
+    if(sys::ExecuteAndWait(*CC, Args, None, {}, 0, 0, &Error) != 0)
+        ReportError("Linking " + Output + " failed " + Error);
+}
+
+/* An ORC JIT for TheTargetMachine's target that resolves runtime symbols
+   (printf, ...) from the compiler process itself */
+unique_ptr<orc::LLJIT> CreateJIT() {
+    orc::JITTargetMachineBuilder JTMB(TheTargetMachine->getTargetTriple());
+    JTMB.setCPU(TheTargetMachine->getTargetCPU());
+    JTMB.addFeatures(SubtargetFeatures(TheTargetMachine->getTargetFeatureString()).getFeatures());
+    JTMB.setCodeGenOptLevel(GetCodeGenOptLevel(TheOptLevel));
+    auto J = Check(orc::LLJITBuilder().setJITTargetMachineBuilder(move(JTMB)).create());
+
+    const DataLayout &DL = J->getDataLayout();
+    J->getMainJITDylib().addGenerator(Check(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
+    return J;
+}
+
+static int RunMain(orc::LLJIT &J) {
+    int (*MainFn)() = (int (*)())LookupJIT(J, "main");
+    int ret = MainFn();
+    fflush(stdout);
+    return ret;
+}
+
+/* Hands TheModule over to J, together with its context */
+void AddModuleJIT(orc::LLJIT &J) {
+    delete TheFPM;
+    TheFPM = nullptr;
+    unique_ptr<Module> M(TheModule);
+    TheModule = nullptr;
+    Builder.reset();
+    M->setDataLayout(J.getDataLayout());
+    Check(J.addIRModule(orc::ThreadSafeModule(move(M), move(TheContext))));
+}
+
+/* Address of a symbol of the modules added to J, compiling them if needed */
+JITTargetAddress LookupJIT(orc::LLJIT &J, StringRef Name) {
+    return Check(J.lookup(Name)).getAddress();
+}
+
+/* Hands TheModule over to an ORC JIT and calls the generated main */
+int RunModuleJIT() {
+    unique_ptr<orc::LLJIT> J;
+    {
+        PhaseTimer t(phase::emit);
+        J = CreateJIT();
+        AddModuleJIT(*J);
+    }
+    return RunMain(*J);
+}
+
+/* Links an object made by EmitObject (e.g. from the cache) into an ORC JIT
+   and calls its main */
+int RunObjectJIT(unique_ptr<MemoryBuffer> Object) {
+    unique_ptr<orc::LLJIT> J;
+    {
+        PhaseTimer t(phase::emit);
+        J = CreateJIT();
+        Check(J->addObjectFile(move(Object)));
+    }
+    return RunMain(*J);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "ast.hpp"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+CodeGenOpt::Level GetCodeGenOptLevel(unsigned OptLevel);
+TargetMachine *CreateTargetMachine(const string &CPU, const string &Features, unsigned OptLevel);
+TargetMachine *CloneTargetMachine(TargetMachine *TM);
+void EmitObject(raw_pwrite_stream &dest);
+void EmitObjectFile(const string &Filename);
+vector<string> EmitObjectFiles(unsigned Jobs);
+void LinkExecutable(const vector<string> &Objects, const string &Output);
+unique_ptr<orc::LLJIT> CreateJIT();
+void AddModuleJIT(orc::LLJIT &J);
+JITTargetAddress LookupJIT(orc::LLJIT &J, StringRef Name);
+int RunModuleJIT();
+int RunObjectJIT(unique_ptr<MemoryBuffer> Object);
@@ -0,0 +1,92 @@
+#include "cache.hpp"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <utime.h>
+
+Expected<unique_ptr<CompileCache>> CompileCache::create(const string &Dir, uint64_t MaxBytes) {
+    if(error_code EC = sys::fs::create_directories(Dir))
+        return make_error<StringError>("Can't create cache directory " + Dir + ": " + EC.message(), EC);
+    return unique_ptr<CompileCache>(new CompileCache(Dir, MaxBytes));
+}
+
+unique_ptr<MemoryBuffer> CompileCache::lookup(const string &Key) {
+    SmallString<128> Path(dir_);
+    sys::path::append(Path, Key);
+    auto Buffer = MemoryBuffer::getFile(Path, -1, false);
+    if(!Buffer)
+        return nullptr;
+    utime(Path.c_str(), nullptr);
+    return move(*Buffer);
+}
+
+/* Writes a temporary file and renames it, so concurrent compilers never
+   see a partial entry */
+void CompileCache::store(const string &Key, StringRef Data) {
+    SmallString<128> Temp(dir_);
+    sys::path::append(Temp, "tmp-%%%%%%%%");
+    int FD;
+    if(sys::fs::createUniqueFile(Temp, FD, Temp))
+        return;
+    {
+        raw_fd_ostream os(FD, true);
+        os << Data;
+    }
+
+    SmallString<128> Path(dir_);
+    sys::path::append(Path, Key);
+    if(sys::fs::rename(Temp, Path)) {
+        sys::fs::remove(Temp);
+        return;
+    }
+    total_bytes_ += Data.size();
+    if(!scanned_ or total_bytes_ > max_bytes_)
+        prune();
+}
+
+/* Measures the entries and, if they don't fit in max_bytes_, removes the
+   least recently used ones. Files still being written by other compilers
+   (tmp-*) are neither counted nor removed */
+void CompileCache::prune() {
+    struct Entry {
+        string path;
+        uint64_t size;
+        sys::TimePoint<> used;
+    };
+    vector<Entry> entries;
+    uint64_t total = 0;
+
+    error_code EC;
+    for(sys::fs::directory_iterator it(dir_, EC), end; it != end and !EC; it.increment(EC)) {
+        if(sys::path::filename(it->path()).startswith("tmp-"))
+            continue;
+        sys::fs::file_status st;
+        if(sys::fs::status(it->path(), st) or st.type() != sys::fs::file_type::regular_file)
+            continue;
+        entries.push_back({it->path(), st.getSize(), st.getLastModificationTime()});
+        total += st.getSize();
+    }
+    scanned_ = true;
+    total_bytes_ = total;
+    if(total <= max_bytes_)
+        return;
+
+    /* Some room is left, so that the next stores don't scan again */
+    uint64_t target = max_bytes_ / 4 * 3;
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+    for(auto &e: entries) {
+        if(total <= target)
+            break;
+        if(!sys::fs::remove(e.path))
+            total -= e.size;
+    }
+    total_bytes_ = total;
+}
+
+string DefaultCacheDirectory() {
+    SmallString<128> Dir;
+    if(!sys::path::cache_directory(Dir))
+        sys::path::system_temp_directory(true, Dir);
+    sys::path::append(Dir, "crompiler");
+    return Dir.str().str();
+}
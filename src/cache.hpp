@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ast.hpp"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/* Content addressed store of compiled outputs in a directory. An entry is a
+   file named after the hash of everything its output depends on (sources,
+   compiler version, options). A hit refreshes the entry's modification
+   time. The directory is scanned by the first store and whenever the
+   entries stored since take it over its size limit; the least recently
+   used entries are then evicted down to three quarters of the limit */
+class CompileCache {
+public:
+	/* Opens the cache in Dir, creating the directory if needed */
+	static Expected<unique_ptr<CompileCache>> create(const string &Dir, uint64_t MaxBytes);
+
+	/* The entry mapped into memory, nullptr on a miss */
+	unique_ptr<MemoryBuffer> lookup(const string &Key);
+	void store(const string &Key, StringRef Data);
+private:
+	CompileCache(const string &Dir, uint64_t MaxBytes) : dir_(Dir), max_bytes_(MaxBytes) {}
+	void prune();
+
+	string dir_;
+	uint64_t max_bytes_;
+	/* Size found by the last scan plus the entries stored since */
+	uint64_t total_bytes_ = 0;
+	bool scanned_ = false;
+};
+
+string DefaultCacheDirectory();
@@ -0,0 +1,318 @@
+#include "compiler.hpp"
+#include "backend.hpp"
+#include "input.hpp"
+#include "stats.hpp"
+
+#include "llvm/Config/llvm-config.h"
+#include <algorithm>
+#include <set>
+
+#ifndef CROMPILER_VERSION
+#define CROMPILER_VERSION "unknown"
+#endif
+
+extern thread_local Module* TheModule;
+extern thread_local TargetMachine *TheTargetMachine;
+
+void ParseBuffer(char *data, size_t size, const string &Name, vector<FunctionNode*> &functions);
+
+Compiler::Compiler(unsigned OptLevel, const string &CPU, const string &Features, unsigned Jobs, bool CheckBounds)
+    : opt_level_(OptLevel), cpu_(CPU), features_(Features), jobs_(max(Jobs, 1u)), check_bounds_(CheckBounds)
+{
+    /* A second Compiler on the thread fails every call instead */
+    if(!TheAst)
+        TheAst = &ast_;
+}
+
+Compiler::~Compiler() {
+    if(TheAst != &ast_)
+        return;
+    FreeModuleAndPassManager();
+    TheAst = nullptr;
+}
+
+/* A failed step leaves no half generated module behind */
+Error Compiler::guard(function_ref<void()> Step) {
+    if(TheAst != &ast_)
+        return make_error<StringError>("Only one Compiler at a time can run on a thread", inconvertibleErrorCode());
+    try {
+        Step();
+    }
+    catch(const CompileError &e) {
+        FreeModuleAndPassManager();
+        return make_error<StringError>(e.message(), inconvertibleErrorCode());
+    }
+    return Error::success();
+}
+
+Error Compiler::addFile(const string &Filename) {
+    PhaseTimer t(phase::parse);
+    return guard([&] {
+        sources_.push_back(make_unique<SourceBuffer>(Filename));
+        names_.push_back(Filename == "-" ? "<stdin>" : Filename);
+    });
+}
+
+void Compiler::addSource(StringRef Source, const string &Name) {
+    sources_.push_back(make_unique<SourceBuffer>(Source.data(), Source.size()));
+    names_.push_back(Name);
+}
+
+void Compiler::clearSources() {
+    if(TheAst == &ast_)
+        FreeModuleAndPassManager();
+    sources_.clear();
+    names_.clear();
+    functions_.clear();
+    source_ends_.clear();
+    program_ = nullptr;
+    ast_.arena.Reset();
+    ast_.symbols.clear();
+    ast_.names.clear();
+}
+
+void Compiler::enableIncremental(CompileCache *Cache) {
+    incremental_ = true;
+    cache_ = Cache;
+}
+
+/* Parses the sources added since the last call. The functions of a
+   source with a syntax error are dropped, so it fails again next time.
+   The ProgramNode is only made again when there are new functions */
+void Compiler::parse() {
+    PhaseTimer t(phase::parse);
+    for(unsigned i = source_ends_.size(); i < sources_.size(); i++) {
+        try {
+            ParseBuffer(sources_[i]->data(), sources_[i]->size(), names_[i], functions_);
+        }
+        catch(const CompileError &) {
+            functions_.resize(source_ends_.empty() ? 0 : source_ends_.back());
+            throw;
+        }
+        source_ends_.push_back(functions_.size());
+        program_ = nullptr;
+    }
+    if(!program_)
+        program_ = new ProgramNode(CopyToArena(functions_));
+}
+
+string Compiler::cacheKey(const string &Kind) const {
+    NodeHasher Hasher;
+    auto add = [&](StringRef s) {
+        Hasher.addString(s);
+    };
+    add(CROMPILER_VERSION);
+    add(LLVM_VERSION_STRING);
+    add(Kind);
+    add(to_string(opt_level_));
+    add(check_bounds_ ? "checked" : "unchecked");
+
+    /* native stands for whatever the host is */
+    if(cpu_ == "native") {
+        add(sys::getHostCPUName());
+        StringMap<bool> HostFeatures;
+        sys::getHostCPUFeatures(HostFeatures);
+        vector<string> features;
+        for(auto &feature: HostFeatures)
+            features.push_back((feature.second ? "+" : "-") + feature.first().str());
+        std::sort(features.begin(), features.end());
+        for(auto &feature: features)
+            add(feature);
+    }
+    else
+        add(cpu_);
+    add(features_);
+
+    for(auto &source: sources_)
+        add(StringRef(source->data(), source->size() - 2));
+    return Hasher.final();
+}
+
+/* Function fingerprints cover the sources and options but not the builds
+   of the compiler and LLVM the code in the disk cache came from */
+static string FunctionCacheKey(StringRef Fingerprint) {
+    NodeHasher Hasher;
+    Hasher.addString(CROMPILER_VERSION);
+    Hasher.addString(LLVM_VERSION_STRING);
+    Hasher.addString("function");
+    Hasher.addString(Fingerprint);
+    return Hasher.final();
+}
+
+Module *Compiler::generate(unsigned begin, unsigned end) {
+    FreeModuleAndPassManager();
+    InitializeModuleAndPassManager(opt_level_, check_bounds_, CreateTargetMachine(cpu_, features_, opt_level_));
+
+    if(!incremental_)
+        program_->codegen(begin, end, jobs_);
+    else {
+        vector<string> fingerprints;
+        for(unsigned i = 0; i < functions_.size(); i++)
+            fingerprints.push_back(program_->fingerprint(i));
+
+        /* Code of this or of earlier processes is tried before generating */
+        set<string> known;
+        for(unsigned i = begin; i < end; i++) {
+            auto &fp = fingerprints[i];
+            if(!function_code_.count(fp) and cache_)
+                if(auto code = cache_->lookup(FunctionCacheKey(fp)))
+                    function_code_[fp] = move(code);
+            if(function_code_.count(fp))
+                known.insert(fp);
+        }
+
+        program_->codegen(begin, end, jobs_, function_code_);
+
+        for(unsigned i = begin; i < end; i++)
+            if(cache_ and !known.count(fingerprints[i]))
+                cache_->store(FunctionCacheKey(fingerprints[i]), function_code_[fingerprints[i]]->getBuffer());
+
+        /* Code of functions no longer in the sources isn't needed again */
+        set<string> current(fingerprints.begin(), fingerprints.end());
+        for(auto it = function_code_.begin(); it != function_code_.end(); ) {
+            auto next = std::next(it);
+            if(!current.count(it->first().str()))
+                function_code_.erase(it);
+            it = next;
+        }
+    }
+    OptimizeModule();
+    return TheModule;
+}
+
+Expected<Module*> Compiler::compile() {
+    Module *M = nullptr;
+    if(Error E = guard([&] {
+        parse();
+        M = generate(0, functions_.size());
+    }))
+        return move(E);
+    return M;
+}
+
+Expected<Module*> Compiler::compileSource(unsigned i) {
+    Module *M = nullptr;
+    if(Error E = guard([&] {
+        parse();
+        M = generate(i ? source_ends_[i - 1] : 0, source_ends_[i]);
+    }))
+        return move(E);
+    return M;
+}
+
+void Compiler::printIR(raw_ostream &os) {
+    PhaseTimer t(phase::emit);
+    TheModule->print(os, nullptr);
+}
+
+Error Compiler::emitObject(const string &Filename) {
+    PhaseTimer t(phase::emit);
+    return guard([&] {
+        EmitObjectFile(Filename);
+    });
+}
+
+Error Compiler::emitExecutable(const string &Filename) {
+    vector<string> Objects;
+    Error E = guard([&] {
+        {
+            PhaseTimer t(phase::emit);
+            Objects = EmitObjectFiles(jobs_);
+        }
+        PhaseTimer t(phase::link);
+        LinkExecutable(Objects, Filename);
+    });
+    for(auto &Object: Objects)
+        sys::fs::remove(Object);
+    return E;
+}
+
+Expected<int> Compiler::run() {
+    int ret = 0;
+    if(Error E = guard([&] {
+        ret = RunModuleJIT();
+    }))
+        return move(E);
+    return ret;
+}
+
+Expected<int> Compiler::interpret(unsigned HotThreshold) {
+    /* Every tier-up is a module of its own; functions compiled before are
+       only declared in it and resolved by the JIT */
+    unique_ptr<orc::LLJIT> jit;
+    int ret = 0;
+    if(Error E = guard([&] {
+        parse();
+        FreeModuleAndPassManager();
+        ret = program_->interpret(HotThreshold, [&](ArrayRef<const FunctionNode*> functions) {
+            InitializeModuleAndPassManager(opt_level_, check_bounds_, CreateTargetMachine(cpu_, features_, opt_level_));
+            {
+                PhaseTimer t(phase::codegen);
+                program_->generateEntries(functions);
+            }
+            OptimizeModule();
+
+            vector<NativeFunction> entries;
+            {
+                PhaseTimer t(phase::emit);
+                if(!jit)
+                    jit = CreateJIT();
+                AddModuleJIT(*jit);
+                for(auto f: functions)
+                    entries.push_back((NativeFunction)LookupJIT(*jit, f->getName() + ".entry"));
+            }
+            FreeModuleAndPassManager();
+            return entries;
+        });
+    }))
+        return move(E);
+    return ret;
+}
+
+unique_ptr<MemoryBuffer> Compiler::irBuffer() {
+    PhaseTimer t(phase::emit);
+    string IR;
+    raw_string_ostream os(IR);
+    TheModule->print(os, nullptr);
+    return MemoryBuffer::getMemBufferCopy(os.str());
+}
+
+Expected<unique_ptr<MemoryBuffer>> Compiler::objectBuffer() {
+    PhaseTimer t(phase::emit);
+    SmallVector<char, 0> Object;
+    if(Error E = guard([&] {
+        raw_svector_ostream os(Object);
+        EmitObject(os);
+    }))
+        return move(E);
+    return MemoryBuffer::getMemBufferCopy(StringRef(Object.data(), Object.size()));
+}
+
+Error Compiler::linkObject(MemoryBufferRef Object, const string &Filename) {
+    PhaseTimer t(phase::link);
+    SmallString<128> Path;
+    int FD;
+    if(error_code EC = sys::fs::createTemporaryFile("r", "o", FD, Path))
+        return make_error<StringError>("Can't create a temporary object file", EC);
+    {
+        raw_fd_ostream os(FD, true);
+        os << Object.getBuffer();
+    }
+    Error E = guard([&] {
+        LinkExecutable({Path.str().str()}, Filename);
+    });
+    sys::fs::remove(Path);
+    return E;
+}
+
+/* A cached object needs no module, only the target to run it on */
+Expected<int> Compiler::runObject(unique_ptr<MemoryBuffer> Object) {
+    int ret = 0;
+    if(Error E = guard([&] {
+        if(!TheTargetMachine)
+            InitializeModuleAndPassManager(opt_level_, check_bounds_, CreateTargetMachine(cpu_, features_, opt_level_));
+        ret = RunObjectJIT(move(Object));
+    }))
+        return move(E);
+    return ret;
+}
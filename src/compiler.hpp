@@ -0,0 +1,86 @@
+#pragma once
+
+#include "ast.hpp"
+#include "cache.hpp"
+#include "input.hpp"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/* One compilation: sources are parsed into an AST, generated into a module
+   of their own LLVMContext and then printed, emitted, linked or run. A
+   Compiler owns the codegen state of the thread it is created on, so
+   Compilers on different threads work independently; a thread runs one
+   Compiler at a time. Errors in the sources, the interpreter or the backend
+   are returned from the call that found them, which leaves the Compiler
+   usable for other sources; only traps in generated code end the process */
+class Compiler {
+public:
+	/* CheckBounds makes array accesses trap on indices out of range */
+	Compiler(unsigned OptLevel, const string &CPU, const string &Features, unsigned Jobs, bool CheckBounds = false);
+	~Compiler();
+	Compiler(const Compiler &) = delete;
+	Compiler &operator=(const Compiler &) = delete;
+
+	/* Reads a file ("-" is stdin) or copies a source held in memory, both
+	   are parsed by the first compile */
+	Error addFile(const string &Filename);
+	void addSource(StringRef Source, const string &Name);
+	unsigned sourceCount() const {
+		return sources_.size();
+	}
+	/* Drops the sources and their AST, for compiling a new version of them */
+	void clearSources();
+
+	/* Keeps the optimized code of every function between compiles, and in
+	   Cache if given, so that compiling edited sources only generates the
+	   functions whose definition or callee signatures changed */
+	void enableIncremental(CompileCache *Cache = nullptr);
+
+	/* Hash of the sources, the compiler version and the options, naming
+	   the output of the given kind ("ir", "object") in a CompileCache */
+	string cacheKey(const string &Kind) const;
+
+	/* Generates and optimizes every source in one module, or only source i
+	   with the functions of the others declared. The module stays owned by
+	   the Compiler and is replaced by the next call */
+	Expected<Module*> compile();
+	Expected<Module*> compileSource(unsigned i);
+
+	void printIR(raw_ostream &os);
+	Error emitObject(const string &Filename);
+	Error emitExecutable(const string &Filename);
+	Expected<int> run();
+	/* Runs the sources in the interpreter; functions called or looping
+	   HotThreshold times are compiled with the JIT, 0 never compiles */
+	Expected<int> interpret(unsigned HotThreshold);
+
+	/* The module as IR text or as an object, for the cache */
+	unique_ptr<MemoryBuffer> irBuffer();
+	Expected<unique_ptr<MemoryBuffer>> objectBuffer();
+	/* Links or runs an object from objectBuffer() */
+	Error linkObject(MemoryBufferRef Object, const string &Filename);
+	Expected<int> runObject(unique_ptr<MemoryBuffer> Object);
+private:
+	/* Runs Step on this Compiler's thread state, returning the
+	   CompileError it throws */
+	Error guard(function_ref<void()> Step);
+	void parse();
+	Module *generate(unsigned begin, unsigned end);
+
+	unsigned opt_level_;
+	string cpu_;
+	string features_;
+	unsigned jobs_;
+	bool check_bounds_;
+	AstContext ast_;
+	vector<unique_ptr<SourceBuffer>> sources_;
+	vector<string> names_;
+	vector<FunctionNode*> functions_;
+	vector<unsigned> source_ends_;
+	/* All of functions_, made by parse() */
+	ProgramNode *program_ = nullptr;
+	bool incremental_ = false;
+	CompileCache *cache_ = nullptr;
+	FunctionCode function_code_;
+};
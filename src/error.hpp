@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+
+using namespace std;
+
+/* An error in the sources or in compiling them. It is thrown where it is
+   found and caught by the Compiler, which returns it as an llvm::Error; it
+   never unwinds through LLVM, which is built without exceptions */
+class CompileError {
+public:
+	explicit CompileError(string Message) : message_(move(Message)) {}
+	const string &message() const {
+		return message_;
+	}
+private:
+	string message_;
+};
+
+[[noreturn]] inline void ReportError(const string &Message) {
+	throw CompileError(Message);
+}
+
+/* First error of tasks run on a ThreadPool, rethrown by the thread waiting
+   for them, as an exception can't leave a pool thread */
+class WorkerErrors {
+public:
+	void add(const CompileError &Error) {
+		lock_guard<mutex> lock(mutex_);
+		if(!failed_)
+			message_ = Error.message();
+		failed_ = true;
+	}
+	bool failed() const {
+		return failed_;
+	}
+	void rethrow() const {
+		if(failed_)
+			ReportError(message_);
+	}
+private:
+	mutex mutex_;
+	bool failed_ = false;
+	string message_;
+};
@@ -0,0 +1,748 @@
+#include "ast.hpp"
+#include "llvm/ADT/DenseMap.h"
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <set>
+
+/* Tree walking interpreter, the first tier of --interpret. Values follow
+   the types the generated code would use, so both tiers compute and print
+   the same. Every call and loop iteration makes the running function
+   hotter; hot functions are compiled and run natively from their next
+   call on, a call already running stays in the interpreter */
+
+extern thread_local const ProgramNode *TheProgram;
+
+/* What the interpreter works out once per function: its inferred variable
+   types and a dense slot for every variable its calls set */
+struct FunctionInfo {
+    TypeEnv types;
+    DenseMap<symbol, unsigned> slots;
+};
+
+/* Locals of an interpreted call, at the slots of its function. A variable
+   gets its slot when a call first sets it, so a frame made before that
+   (a caller further up in a recursion) may hold fewer values than there
+   are slots */
+class Frame {
+public:
+    explicit Frame(FunctionInfo &Info) : info_(Info), values_(Info.slots.size()) {}
+    EvalValue lookup(symbol s) const {
+        auto it = info_.slots.find(s);
+        if(it == info_.slots.end() or it->second >= values_.size())
+            return EvalValue();
+        return values_[it->second];
+    }
+    void set(symbol s, EvalValue val) {
+        unsigned slot = info_.slots.insert({s, (unsigned)info_.slots.size()}).first->second;
+        if(slot >= values_.size())
+            values_.resize(slot + 1);
+        values_[slot] = move(val);
+    }
+    void clear() {
+        values_.assign(info_.slots.size(), EvalValue());
+    }
+private:
+    FunctionInfo &info_;
+    SmallVector<EvalValue, 8> values_;
+};
+
+/* Locals of the running call, its function and the function's inferred
+   variable types */
+static thread_local Frame *Locals;
+static thread_local const FunctionNode *Running;
+static thread_local const TypeEnv *LocalTypes;
+
+/* A return unwinds the running call: blocks and loops stop once Returning
+   is set. Calls of the running function in return position leave their
+   arguments in TailArgs, and the call starts over with them */
+static thread_local bool Returning;
+static thread_local EvalValue ReturnValue;
+static thread_local bool TailCall;
+static thread_local vector<EvalValue> TailArgs;
+
+/* return(x + f(...)) and return(x * f(...)) on ints fold x into the
+   running call's Accumulated before starting over, as returngen does; the
+   call applies it to the value it finally returns. Other recursion nests
+   calls on the C++ stack, up to MaxDepth of them */
+static thread_local bool Accumulating;
+static thread_local bin_op AccumulatedOp;
+static thread_local EvalValue Accumulated;
+static thread_local unsigned Depth;
+static const unsigned MaxDepth = 2000;
+
+/* Tiering, by function symbol */
+static thread_local ScopeTable<unsigned> Hotness;
+static thread_local ScopeTable<NativeFunction> NativeCode;
+static thread_local ScopeTable<FunctionInfo*> FunctionInfos;
+static thread_local deque<FunctionInfo> Infos;
+static thread_local unsigned HotThreshold;
+static thread_local const TierUp *Compile;
+
+static EvalValue EvalInt(int i) {
+    EvalValue v;
+    v.type = my_type::int_;
+    v.valid = true;
+    v.i = i;
+    return v;
+}
+
+static EvalValue EvalLong(int64_t i) {
+    EvalValue v;
+    v.type = my_type::long_;
+    v.valid = true;
+    v.i = i;
+    return v;
+}
+
+/* Floats are kept in d, rounded to float */
+static EvalValue EvalFloat(float f) {
+    EvalValue v;
+    v.type = my_type::float_;
+    v.valid = true;
+    v.d = f;
+    return v;
+}
+
+static EvalValue EvalDouble(double d) {
+    EvalValue v;
+    v.type = my_type::double_;
+    v.valid = true;
+    v.d = d;
+    return v;
+}
+
+static EvalValue EvalArray(my_type t, shared_ptr<vector<double>> elements) {
+    EvalValue v;
+    v.type = t;
+    v.valid = true;
+    v.elements = move(elements);
+    return v;
+}
+
+static bool IsArray(const EvalValue &v) {
+    return IsArrayType(v.type);
+}
+
+static bool IsInteger(const EvalValue &v) {
+    return v.type == my_type::int_ or v.type == my_type::long_;
+}
+
+static void CheckScalar(const EvalValue &v) {
+    if(IsArray(v))
+        ReportError("Array used as a scalar");
+}
+
+static int64_t AsLong(const EvalValue &v) {
+    CheckScalar(v);
+    return IsInteger(v) ? v.i : (int64_t)v.d;
+}
+
+/* Longs are truncated, as by the generated code */
+static int AsInt(const EvalValue &v) {
+    CheckScalar(v);
+    return IsInteger(v) ? (int)(uint32_t)v.i : (int)v.d;
+}
+
+static float AsFloat(const EvalValue &v) {
+    CheckScalar(v);
+    return IsInteger(v) ? (float)v.i : (float)v.d;
+}
+
+static double AsDouble(const EvalValue &v) {
+    CheckScalar(v);
+    return IsInteger(v) ? (double)v.i : v.d;
+}
+
+/* Like ConvertScalar */
+static EvalValue ConvertEval(const EvalValue &v, my_type t) {
+    switch(t) {
+        case my_type::long_:
+            return EvalLong(AsLong(v));
+        case my_type::float_:
+            return EvalFloat(AsFloat(v));
+        case my_type::double_:
+            return EvalDouble(AsDouble(v));
+        default:
+            return EvalInt(AsInt(v));
+    }
+}
+
+/* i32 and i64 arithmetic wraps around like the generated code */
+static int Wrap(int64_t v) {
+    return (int)(uint32_t)v;
+}
+
+static int64_t WrapLong(uint64_t v) {
+    return (int64_t)v;
+}
+
+/* Longs travel in doubles as their bits: array elements and the arguments
+   and results of compiled functions */
+static double LongBits(int64_t i) {
+    double d;
+    memcpy(&d, &i, sizeof(d));
+    return d;
+}
+
+static int64_t BitsLong(double d) {
+    int64_t i;
+    memcpy(&i, &d, sizeof(i));
+    return i;
+}
+
+static EvalValue GetElement(const EvalValue &array, size_t i) {
+    double e = (*array.elements)[i];
+    switch(array.type) {
+        case my_type::int_array:
+            return EvalInt((int)e);
+        case my_type::long_array:
+            return EvalLong(BitsLong(e));
+        case my_type::float_array:
+            return EvalFloat((float)e);
+        default:
+            return EvalDouble(e);
+    }
+}
+
+/* Stores v converted to the element type, returns the stored value */
+static EvalValue SetElement(const EvalValue &array, size_t i, const EvalValue &v) {
+    EvalValue e = ConvertEval(v, ArrayElementType(array.type));
+    (*array.elements)[i] = IsInteger(e) ? (e.type == my_type::long_ ? LongBits(e.i) : e.i) : e.d;
+    return e;
+}
+
+static void CountBackedge() {
+    symbol id = Running->getPrototype().getId();
+    Hotness.set(id, Hotness.lookup(id) + 1);
+}
+
+/* Arrays share their elements, so writes through the copy are seen */
+static EvalValue ArrayVariable(symbol id) {
+    EvalValue v = Locals->lookup(id);
+    if(!IsArray(v))
+        ReportError("Not an array: " + SymbolName(id));
+    return v;
+}
+
+static size_t ArrayIndex(symbol id, const EvalValue &array, const EvalValue &index) {
+    int64_t i = AsLong(index);
+    if(i < 0 or (size_t)i >= array.elements->size())
+        ReportError("Index " + to_string(i) + " out of range for " + SymbolName(id));
+    return i;
+}
+
+EvalValue VariableNode::eval() const {
+    EvalValue v = Locals->lookup(id_);
+    if(!v.valid)
+        ReportError("Variable doesn't exist: " + SymbolName(id_));
+    return v;
+}
+
+EvalValue IntNode::eval() const {
+    return EvalInt(num_);
+}
+
+EvalValue DoubleNode::eval() const {
+    return EvalDouble(num_);
+}
+
+/* Scalars keep the type of the variable they go to, arrays are copied */
+EvalValue AssignmentNode::eval() const {
+    EvalValue val = e_->eval();
+    if(IsArray(val)) {
+        Locals->set(id_, EvalArray(val.type, make_shared<vector<double>>(*val.elements)));
+        return EvalInt(0);
+    }
+
+    EvalValue old = Locals->lookup(id_);
+    my_type t = my_type::int_;
+    if(old.valid and !IsArray(old))
+        t = old.type;
+    else {
+        auto it = LocalTypes->find(id_);
+        if(it != LocalTypes->end() and !IsArrayType(it->second))
+            t = it->second;
+        t = MergeTypes(t, val.type);
+    }
+    val = ConvertEval(val, t);
+    Locals->set(id_, val);
+    return val;
+}
+
+EvalValue ArrayAssignmentNode::eval() const {
+    my_type t = my_type::int_;
+    for(auto &el: ve_)
+        t = MergeTypes(t, ArrayElementType(el->type(*LocalTypes)));
+
+    EvalValue array = EvalArray(ArrayOf(t), make_shared<vector<double>>(ve_.size()));
+    for(size_t i = 0; i < ve_.size(); i++)
+        SetElement(array, i, ve_[i]->eval());
+    Locals->set(id_, array);
+    return EvalInt(0);
+}
+
+EvalValue AccessArrayNode::eval() const {
+    EvalValue index = e_->eval();
+    EvalValue array = ArrayVariable(id_);
+    return GetElement(array, ArrayIndex(id_, array, index));
+}
+
+EvalValue ModifyArrayNode::eval() const {
+    EvalValue index = e1_->eval();
+    size_t i = ArrayIndex(id_, ArrayVariable(id_), index);
+    EvalValue nval = e2_->eval();
+
+    return SetElement(ArrayVariable(id_), i, nval);
+}
+
+EvalValue SequenceNode::eval() const {
+    double start = AsDouble(start_->eval());
+    double end = AsDouble(end_->eval());
+    double step = AsDouble(step_->eval());
+
+    unsigned n = SequenceLength(start, end, step);
+    EvalValue array = EvalArray(sequenceType(*LocalTypes), make_shared<vector<double>>(n));
+    for(unsigned i = 0; i < n; i++)
+        SetElement(array, i, EvalDouble(start + i * step));
+    Locals->set(id_, array);
+    return EvalDouble(0.0);
+}
+
+static EvalValue EvalScalarOperator(bin_op op, const EvalValue &l, const EvalValue &d) {
+    my_type t = MergeTypes(l.type, d.type);
+    if(t == my_type::int_) {
+        int a = AsInt(l), b = AsInt(d);
+        switch(op) {
+            case bin_op::plus:
+                return EvalInt(Wrap((int64_t)a + b));
+            case bin_op::minus:
+                return EvalInt(Wrap((int64_t)a - b));
+            case bin_op::mul:
+                return EvalInt(Wrap((int64_t)a * b));
+            case bin_op::di:
+                if(b == 0)
+                    ReportError("Integer division by zero");
+                return EvalInt(Wrap((int64_t)a / b));
+            case bin_op::gt:
+                return EvalInt(a > b);
+            case bin_op::lt:
+                return EvalInt(a < b);
+            case bin_op::geq:
+                return EvalInt(a >= b);
+            case bin_op::leq:
+                return EvalInt(a <= b);
+            case bin_op::eq:
+                return EvalInt(a == b);
+            default:
+                return EvalInt(a != b);
+        }
+    }
+
+    if(t == my_type::long_) {
+        int64_t a = AsLong(l), b = AsLong(d);
+        switch(op) {
+            case bin_op::plus:
+                return EvalLong(WrapLong((uint64_t)a + b));
+            case bin_op::minus:
+                return EvalLong(WrapLong((uint64_t)a - b));
+            case bin_op::mul:
+                return EvalLong(WrapLong((uint64_t)a * b));
+            case bin_op::di:
+                if(b == 0)
+                    ReportError("Integer division by zero");
+                return EvalLong(b == -1 ? WrapLong(0 - (uint64_t)a) : a / b);
+            case bin_op::gt:
+                return EvalInt(a > b);
+            case bin_op::lt:
+                return EvalInt(a < b);
+            case bin_op::geq:
+                return EvalInt(a >= b);
+            case bin_op::leq:
+                return EvalInt(a <= b);
+            case bin_op::eq:
+                return EvalInt(a == b);
+            default:
+                return EvalInt(a != b);
+        }
+    }
+
+    /* Floats compute in single precision. Comparisons are unordered, true
+       if either side is NaN */
+    if(t == my_type::float_) {
+        float a = AsFloat(l), b = AsFloat(d);
+        switch(op) {
+            case bin_op::plus:
+                return EvalFloat(a + b);
+            case bin_op::minus:
+                return EvalFloat(a - b);
+            case bin_op::mul:
+                return EvalFloat(a * b);
+            case bin_op::di:
+                return EvalFloat(a / b);
+            default:
+                break;
+        }
+    }
+    double a = AsDouble(l), b = AsDouble(d);
+    switch(op) {
+        case bin_op::plus:
+            return EvalDouble(a + b);
+        case bin_op::minus:
+            return EvalDouble(a - b);
+        case bin_op::mul:
+            return EvalDouble(a * b);
+        case bin_op::di:
+            return EvalDouble(a / b);
+        case bin_op::gt:
+            return EvalInt(!(a <= b));
+        case bin_op::lt:
+            return EvalInt(!(a >= b));
+        case bin_op::geq:
+            return EvalInt(!(a < b));
+        case bin_op::leq:
+            return EvalInt(!(a > b));
+        case bin_op::eq:
+            return EvalInt(a == b or std::isnan(a) or std::isnan(b));
+        default:
+            return EvalInt(!(a == b));
+    }
+}
+
+/* Element-wise on arrays, up to the shorter one; scalars apply to every
+   element */
+EvalValue BinaryOperatorNode::eval() const {
+    /* and/or short-circuit, as in the generated code */
+    if(op_ == bin_op::and_ or op_ == bin_op::or_) {
+        bool truth = AsDouble(l_->eval()) != 0.0;
+        if(truth == (op_ == bin_op::and_))
+            truth = AsDouble(r_->eval()) != 0.0;
+        return EvalInt(truth);
+    }
+
+    EvalValue l = l_->eval();
+    EvalValue d = r_->eval();
+    if(!IsArray(l) and !IsArray(d))
+        return EvalScalarOperator(op_, l, d);
+
+    if(op_ != bin_op::plus and op_ != bin_op::minus and op_ != bin_op::mul and op_ != bin_op::di)
+        ReportError("Only +, -, * and / work element-wise on arrays");
+    size_t length = IsArray(l) ? l.elements->size() : d.elements->size();
+    if(IsArray(l) and IsArray(d))
+        length = min(length, d.elements->size());
+
+    auto element = [](const EvalValue &v, size_t i) {
+        return IsArray(v) ? GetElement(v, i) : v;
+    };
+    my_type t = MergeTypes(ArrayElementType(l.type), ArrayElementType(d.type));
+    EvalValue result = EvalArray(ArrayOf(t), make_shared<vector<double>>(length));
+    for(size_t i = 0; i < length; i++)
+        SetElement(result, i, EvalScalarOperator(op_, element(l, i), element(d, i)));
+    return result;
+}
+
+/* Ordered, false when either side is NaN */
+static bool Less(const EvalValue &a, const EvalValue &b) {
+    if(IsInteger(a) and IsInteger(b))
+        return AsLong(a) < AsLong(b);
+    return AsDouble(a) < AsDouble(b);
+}
+
+/* Neutral element of a reduction over elements of type t */
+static EvalValue ReductionIdentity(red_op op, my_type t) {
+    switch(op) {
+        case red_op::prod:
+            return ConvertEval(EvalInt(1), t);
+        case red_op::min:
+            if(t == my_type::int_)
+                return EvalInt(numeric_limits<int>::max());
+            if(t == my_type::long_)
+                return EvalLong(numeric_limits<int64_t>::max());
+            return ConvertEval(EvalDouble(HUGE_VAL), t);
+        case red_op::max:
+            if(t == my_type::int_)
+                return EvalInt(numeric_limits<int>::min());
+            if(t == my_type::long_)
+                return EvalLong(numeric_limits<int64_t>::min());
+            return ConvertEval(EvalDouble(-HUGE_VAL), t);
+        default:
+            return ConvertEval(EvalInt(0), t);
+    }
+}
+
+EvalValue ReductionNode::eval() const {
+    EvalValue val = e_->eval();
+    if(!IsArray(val))
+        return op_ == red_op::mean ? EvalDouble(AsDouble(val)) : val;
+
+    /* The accumulator has the element type, a double for mean */
+    size_t n = val.elements->size();
+    my_type t = op_ == red_op::mean ? my_type::double_ : ArrayElementType(val.type);
+    EvalValue acc = ReductionIdentity(op_, t);
+    for(size_t i = 0; i < n; i++) {
+        EvalValue e = GetElement(val, i);
+        switch(op_) {
+            case red_op::prod:
+                acc = EvalScalarOperator(bin_op::mul, acc, e);
+                break;
+            case red_op::min:
+                acc = Less(e, acc) ? e : acc;
+                break;
+            case red_op::max:
+                acc = Less(acc, e) ? e : acc;
+                break;
+            default:
+                acc = EvalScalarOperator(bin_op::plus, acc, e);
+        }
+    }
+    if(op_ == red_op::mean)
+        acc = EvalDouble(acc.d / n);
+    return acc;
+}
+
+void ExpressionNode::returneval() const {
+    ReturnValue = ConvertEval(eval(), Running->getPrototype().getReturnType());
+}
+
+void FunctionCallNode::returneval() const {
+    if(!isCallTo(Running->getPrototype().getId())) {
+        ExpressionNode::returneval();
+        return;
+    }
+    TailArgs = evalArgs();
+    TailCall = true;
+}
+
+/* Same conditions as BinaryOperatorNode::returngen */
+void BinaryOperatorNode::returneval() const {
+    my_type t = Running->getPrototype().getReturnType();
+    my_type l_type = l_->type(*LocalTypes);
+    if((op_ != bin_op::plus and op_ != bin_op::mul) or (Accumulating and AccumulatedOp != op_)
+       or (t != my_type::int_ and t != my_type::long_) or !r_->isCallTo(Running->getPrototype().getId())
+       or (l_type != my_type::int_ and l_type != my_type::long_)) {
+        ExpressionNode::returneval();
+        return;
+    }
+
+    if(!Accumulating) {
+        Accumulating = true;
+        AccumulatedOp = op_;
+        Accumulated = ConvertEval(EvalInt(op_ == bin_op::mul ? 1 : 0), t);
+    }
+    EvalValue val = ConvertEval(l_->eval(), t);
+    Accumulated = ConvertEval(EvalScalarOperator(op_, Accumulated, val), t);
+    r_->returneval();
+}
+
+EvalValue ReturnNode::eval() const {
+    e_->returneval();
+    Returning = true;
+    return ReturnValue;
+}
+
+EvalValue BlockNode::eval() const {
+    for(unsigned i = 0; i < statements_.size() - 1; i++) {
+        EvalValue val = statements_[i]->eval();
+        if(Returning)
+            return val;
+    }
+    return statements_.back()->eval();
+}
+
+EvalValue PrintNode::eval() const {
+    EvalValue val = e_->eval();
+    if(IsArray(val))
+        ReportError("Can't print an array");
+    if(val.type == my_type::int_)
+        printf("%d\n", (int)val.i);
+    else if(val.type == my_type::long_)
+        printf("%" PRId64 "\n", val.i);
+    else
+        printf(Running->getName() == "main" ? "%lf\n" : "%.2lf\n", val.d);
+    return val;
+}
+
+EvalValue EmptyNode::eval() const {
+    return EvalInt(0);
+}
+
+EvalValue FunctionCallNode::eval() const {
+    vector<EvalValue> args = evalArgs();
+    return TheProgram->lookup(id_)->call(move(args));
+}
+
+vector<EvalValue> FunctionCallNode::evalArgs() const {
+    const FunctionNode* f = TheProgram->lookup(id_);
+    if(!f)
+        ReportError("Function is not defined: " + SymbolName(id_));
+    if(f->getPrototype().getParams().size() != params_.size())
+        ReportError("Wrong argument size: given " + SymbolName(id_) + ", expected " + to_string(f->getPrototype().getParams().size()));
+
+    vector<EvalValue> args;
+    for(auto &param: params_)
+        args.push_back(param->eval());
+    return args;
+}
+
+EvalValue IfElseNode::eval() const {
+    if(AsDouble(cond_->eval()) != 0.0)
+        return then_->eval();
+    return else_->eval();
+}
+
+/* Counts from start to end, down when start > end; both are evaluated
+   once. Changes of the variable in the body don't affect the iteration */
+EvalValue ForLoopNode::eval() const {
+    my_type t = counterType(*LocalTypes);
+    int64_t start = AsLong(ConvertEval(start_->eval(), t));
+    int64_t end = AsLong(ConvertEval(end_->eval(), t));
+    int64_t step = start > end ? -1 : 1;
+    EvalValue shadowed = Locals->lookup(id_);
+    for(int64_t i = start;; i += step) {
+        Locals->set(id_, ConvertEval(EvalLong(i), t));
+        body_->eval();
+        if(Returning or i == end)
+            break;
+        CountBackedge();
+    }
+    Locals->set(id_, shadowed);
+    return EvalInt(0);
+}
+
+EvalValue WhileNode::eval() const {
+    do {
+        body_->eval();
+        if(Returning)
+            break;
+        CountBackedge();
+    } while(AsDouble(cond_->eval()) != 0.0);
+    return EvalInt(0);
+}
+
+/* Compiles f and the functions it reaches that aren't compiled yet */
+static void Promote(const FunctionNode *f) {
+    vector<const FunctionNode*> functions = {f};
+    set<symbol> seen = {f->getPrototype().getId()};
+    for(unsigned i = 0; i < functions.size(); i++)
+        for(symbol callee: functions[i]->callees()) {
+            const FunctionNode* g = TheProgram->lookup(callee);
+            if(g and !NativeCode.lookup(callee) and seen.insert(callee).second)
+                functions.push_back(g);
+        }
+
+    if(TraceCodegen)
+        clog << "tier-up: " << f->getName() << " (" << functions.size() << " functions)\n";
+    vector<NativeFunction> entries = (*Compile)(functions);
+    for(unsigned i = 0; i < functions.size(); i++)
+        NativeCode.set(functions[i]->getPrototype().getId(), entries[i]);
+}
+
+EvalValue FunctionNode::call(vector<EvalValue> args) const {
+    symbol id = prototype_.getId();
+    auto params = prototype_.getParams();
+    FunctionInfo *info = FunctionInfos.lookup(id);
+    if(!info) {
+        TypeEnv env;
+        for(auto &param: params)
+            env[param.second] = param.first;
+        Infos.push_back({InferTypes(body_, env), {}});
+        info = &Infos.back();
+        FunctionInfos.set(id, info);
+    }
+
+    /* Deeper calls would overflow the stack, they have to run natively */
+    bool deep = Depth >= MaxDepth;
+    if(!NativeCode.lookup(id) and HotThreshold and (Hotness.lookup(id) >= HotThreshold or deep))
+        Promote(this);
+    if(!NativeCode.lookup(id) and deep)
+        ReportError("Recursion deeper than " + to_string(MaxDepth) + " calls in the interpreter: " + getName());
+
+    if(NativeFunction native = NativeCode.lookup(id)) {
+        vector<double> a;
+        for(unsigned i = 0; i < args.size(); i++)
+            a.push_back(params[i].first == my_type::long_ ? LongBits(AsLong(args[i])) : AsDouble(args[i]));
+        double result = native(a.data());
+        if(prototype_.getReturnType() == my_type::long_)
+            return EvalLong(BitsLong(result));
+        return ConvertEval(EvalDouble(result), prototype_.getReturnType());
+    }
+    Hotness.set(id, Hotness.lookup(id) + 1);
+
+    auto saved_locals = Locals;
+    auto saved_running = Running;
+    auto saved_types = LocalTypes;
+    auto saved_accumulating = Accumulating;
+    auto saved_op = AccumulatedOp;
+    auto saved_accumulated = Accumulated;
+    Running = this;
+    LocalTypes = &info->types;
+    Accumulating = false;
+    Depth++;
+
+    EvalValue result;
+    bool returned;
+    Frame locals(*info);
+    Locals = &locals;
+    for(;;) {
+        for(unsigned i = 0; i < params.size(); i++)
+            locals.set(params[i].second, ConvertEval(args[i], params[i].first));
+        result = body_->eval();
+        returned = Returning;
+        Returning = false;
+        if(!TailCall)
+            break;
+        TailCall = false;
+        args = move(TailArgs);
+        locals.clear();
+        CountBackedge();
+    }
+    Depth--;
+
+    my_type t = prototype_.getReturnType();
+    if(returned)
+        result = ReturnValue;
+    /* main returns 0 unless it returns something else */
+    else if(prototype_.getName() == "main")
+        result = EvalInt(0);
+    else
+        result = ConvertEval(result, t);
+    if(Accumulating)
+        result = ConvertEval(EvalScalarOperator(AccumulatedOp, Accumulated, result), t);
+
+    Locals = saved_locals;
+    Running = saved_running;
+    LocalTypes = saved_types;
+    Accumulating = saved_accumulating;
+    AccumulatedOp = saved_op;
+    Accumulated = saved_accumulated;
+    return result;
+}
+
+int ProgramNode::interpret(unsigned Threshold, const TierUp &Tier) const {
+    TheProgram = this;
+    HotThreshold = Threshold;
+    Compile = &Tier;
+    Hotness.clear();
+    NativeCode.clear();
+    FunctionInfos.clear();
+    Infos.clear();
+    /* An error may have ended the last run in the middle of a call */
+    Locals = nullptr;
+    Running = nullptr;
+    LocalTypes = nullptr;
+    Returning = false;
+    TailCall = false;
+    Accumulating = false;
+    Depth = 0;
+
+    const FunctionNode* main = lookup(Intern("main"));
+    if(!main)
+        ReportError("No main function");
+    int ret = AsInt(main->call({}));
+    fflush(stdout);
+    Compile = nullptr;
+    return ret;
+}
@@ -0,0 +1,202 @@
+#include "ast.hpp"
+#include <algorithm>
+
+extern thread_local TargetMachine *TheTargetMachine;
+extern thread_local unsigned TheOptLevel;
+
+/* Fingerprints identify the code generated for a function: its definition,
+   the signatures of the functions it calls and the target. Identifiers are
+   hashed by name, so they don't depend on the order of interning */
+
+void NodeHasher::addInt(uint64_t v) {
+    sha_.update(ArrayRef<uint8_t>((const uint8_t*)&v, sizeof(v)));
+}
+
+void NodeHasher::addDouble(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    addInt(bits);
+}
+
+void NodeHasher::addString(StringRef s) {
+    addInt(s.size());
+    sha_.update(ArrayRef<uint8_t>((const uint8_t*)s.data(), s.size()));
+}
+
+void NodeHasher::addNodes(ArrayRef<ExpressionNode*> ve) {
+    addInt(ve.size());
+    for(auto e: ve)
+        e->hash(*this);
+}
+
+void NodeHasher::addCall(symbol s) {
+    addSymbol(s);
+    calls_.push_back(s);
+}
+
+string NodeHasher::final() {
+    return toHex(sha_.final(), true);
+}
+
+void VariableNode::hash(NodeHasher &h) const {
+    h.add(node_kind::variable);
+    h.addSymbol(id_);
+}
+
+void IntNode::hash(NodeHasher &h) const {
+    h.add(node_kind::int_);
+    h.addInt(num_);
+}
+
+void DoubleNode::hash(NodeHasher &h) const {
+    h.add(node_kind::double_);
+    h.addDouble(num_);
+}
+
+void AssignmentNode::hash(NodeHasher &h) const {
+    h.add(node_kind::assignment);
+    h.addSymbol(id_);
+    e_->hash(h);
+}
+
+void ArrayAssignmentNode::hash(NodeHasher &h) const {
+    h.add(node_kind::array_assignment);
+    h.addSymbol(id_);
+    h.addNodes(ve_);
+}
+
+void AccessArrayNode::hash(NodeHasher &h) const {
+    h.add(node_kind::access_array);
+    h.addSymbol(id_);
+    e_->hash(h);
+}
+
+void ModifyArrayNode::hash(NodeHasher &h) const {
+    h.add(node_kind::modify_array);
+    h.addSymbol(id_);
+    e1_->hash(h);
+    e2_->hash(h);
+}
+
+void BinaryOperatorNode::hash(NodeHasher &h) const {
+    h.add(node_kind::binary_operator);
+    h.addInt((uint64_t)op_);
+    l_->hash(h);
+    r_->hash(h);
+}
+
+void ReturnNode::hash(NodeHasher &h) const {
+    h.add(node_kind::return_);
+    e_->hash(h);
+}
+
+void BlockNode::hash(NodeHasher &h) const {
+    h.add(node_kind::block);
+    h.addNodes(statements_);
+}
+
+void PrintNode::hash(NodeHasher &h) const {
+    h.add(node_kind::print);
+    e_->hash(h);
+}
+
+void EmptyNode::hash(NodeHasher &h) const {
+    h.add(node_kind::empty);
+}
+
+void FunctionCallNode::hash(NodeHasher &h) const {
+    h.add(node_kind::function_call);
+    h.addCall(id_);
+    h.addNodes(params_);
+}
+
+void SequenceNode::hash(NodeHasher &h) const {
+    h.add(node_kind::sequence);
+    h.addSymbol(id_);
+    start_->hash(h);
+    end_->hash(h);
+    step_->hash(h);
+}
+
+void ReductionNode::hash(NodeHasher &h) const {
+    h.add(node_kind::reduction);
+    h.addInt((uint64_t)op_);
+    e_->hash(h);
+}
+
+void IfElseNode::hash(NodeHasher &h) const {
+    h.add(node_kind::if_else);
+    cond_->hash(h);
+    then_->hash(h);
+    else_->hash(h);
+}
+
+void ForLoopNode::hash(NodeHasher &h) const {
+    h.add(node_kind::for_loop);
+    h.addSymbol(id_);
+    start_->hash(h);
+    end_->hash(h);
+    body_->hash(h);
+}
+
+void WhileNode::hash(NodeHasher &h) const {
+    h.add(node_kind::while_);
+    cond_->hash(h);
+    body_->hash(h);
+}
+
+/* What callers depend on: name, parameter and return types */
+void FunctionPrototypeNode::hashSignature(NodeHasher &h) const {
+    h.add(node_kind::function_prototype);
+    h.addSymbol(id_);
+    h.addInt((uint64_t)ret_type_);
+    h.addInt(params_.size());
+    for(auto &param: params_)
+        h.addInt((uint64_t)param.first);
+}
+
+void FunctionNode::hash(NodeHasher &h) const {
+    h.add(node_kind::function);
+    prototype_.hashSignature(h);
+    for(auto &param: prototype_.getParams())
+        h.addSymbol(param.second);
+    body_->hash(h);
+}
+
+/* Functions called by the body, in order of their first call */
+vector<symbol> FunctionNode::callees() const {
+    NodeHasher h;
+    body_->hash(h);
+    vector<symbol> calls;
+    for(symbol s: h.calls())
+        if(find(calls.begin(), calls.end(), s) == calls.end())
+            calls.push_back(s);
+    return calls;
+}
+
+/* A body change only regenerates its own function, a signature change also
+   regenerates its callers. Inlining across functions happens in the module
+   passes, which run on the linked module every time */
+string ProgramNode::fingerprint(unsigned i) const {
+    NodeHasher h;
+    h.addString(TheTargetMachine->getTargetTriple().str());
+    h.addString(TheTargetMachine->getTargetCPU());
+    h.addString(TheTargetMachine->getTargetFeatureString());
+    h.addInt(TheOptLevel);
+    h.addInt(CheckBounds);
+
+    functions_[i]->hash(h);
+    vector<symbol> calls = h.calls();
+    std::sort(calls.begin(), calls.end(), [](symbol a, symbol b) {
+        return SymbolName(a) < SymbolName(b);
+    });
+    calls.erase(unique(calls.begin(), calls.end()), calls.end());
+    for(symbol s: calls) {
+        const FunctionNode *callee = lookup(s);
+        if(callee)
+            callee->getPrototype().hashSignature(h);
+        else
+            h.addSymbol(s);
+    }
+    return h.final();
+}
@@ -0,0 +1,82 @@
+#include "input.hpp"
+#include "error.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+[[noreturn]] static void ReadError(const string &Filename, int fd) {
+    string message = "Can't read " + Filename + ": " + strerror(errno);
+    if(fd >= 0 and fd != STDIN_FILENO)
+        close(fd);
+    ReportError(message);
+}
+
+SourceBuffer::SourceBuffer(const string &Filename)
+    : data_(nullptr), size_(0), mapped_(false)
+{
+    int fd = Filename == "-" ? STDIN_FILENO : open(Filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        ReadError(Filename, fd);
+
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+        ReadError(Filename, fd);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t tail = S_ISREG(st.st_mode) ? st.st_size % page : 0;
+    if(tail != 0 and page - tail >= 2) {
+        /* Flex writes into the buffer while scanning, so map it private */
+        void *p = mmap(nullptr, st.st_size + 2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED) {
+            madvise(p, st.st_size + 2, MADV_SEQUENTIAL);
+            data_ = (char*)p;
+            size_ = st.st_size + 2;
+            mapped_ = true;
+        }
+    }
+
+    if(!mapped_) {
+        size_t capacity = S_ISREG(st.st_mode) ? st.st_size + 2 : 1 << 16;
+        data_ = (char*)malloc(capacity);
+        for(;;) {
+            if(size_ + 2 == capacity) {
+                capacity *= 2;
+                data_ = (char*)realloc(data_, capacity);
+            }
+            ssize_t n = read(fd, data_ + size_, capacity - size_ - 2);
+            if(n == 0)
+                break;
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
+                free(data_);
+                ReadError(Filename, fd);
+            }
+            size_ += n;
+        }
+        data_[size_++] = '\0';
+        data_[size_++] = '\0';
+    }
+
+    if(fd != STDIN_FILENO)
+        close(fd);
+}
+
+SourceBuffer::SourceBuffer(const char *Text, size_t Size)
+    : data_((char*)malloc(Size + 2)), size_(Size + 2), mapped_(false)
+{
+    memcpy(data_, Text, Size);
+    data_[Size] = '\0';
+    data_[Size + 1] = '\0';
+}
+
+SourceBuffer::~SourceBuffer() {
+    if(mapped_)
+        munmap(data_, size_);
+    else
+        free(data_);
+}
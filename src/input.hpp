@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+/* Source text followed by the two NUL bytes flex needs for yy_scan_buffer.
+   A regular file is mapped copy-on-write when the zero fill of its last
+   page has room for them, anything else (stdin, pipes, files ending on a
+   page boundary) is read into memory */
+class SourceBuffer {
+public:
+	SourceBuffer(const string &Filename);
+	SourceBuffer(const char *Text, size_t Size);
+	~SourceBuffer();
+	SourceBuffer(const SourceBuffer &) = delete;
+	SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+	/* The text and its size, the terminating NULs included */
+	char *data() {
+		return data_;
+	}
+	size_t size() const {
+		return size_;
+	}
+private:
+	char *data_;
+	size_t size_;
+	bool mapped_;
+};
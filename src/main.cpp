@@ -0,0 +1,148 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include "cache.hpp"
+#include "compiler.hpp"
+#include "stats.hpp"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+using namespace std;
+
+/* a/b.r -> b.o, like cc -c */
+static string ObjectFilename(const string &Input) {
+	SmallString<128> Object(sys::path::filename(Input));
+	sys::path::replace_extension(Object, "o");
+	return Object.str().str();
+}
+
+static cl::list<string> InputFilenames(cl::Positional, cl::desc("<input files, stdin if none or '-'>"), cl::ZeroOrMore);
+static cl::opt<unsigned> OptLevel("O", cl::desc("Optimization level: -O0, -O1, -O2 or -O3 (default -O0)"), cl::Prefix, cl::ZeroOrMore, cl::init(0));
+static cl::opt<bool> RunJIT("run", cl::desc("Run the program in-process with the JIT instead of printing IR"));
+static cl::opt<bool> Interpret("interpret", cl::desc("Run the program in the interpreter, compiling hot functions with the JIT (at -O2 unless -O is given)"));
+static cl::opt<unsigned> HotThreshold("hot-threshold", cl::desc("Calls plus loop iterations after which --interpret compiles a function, 0 for never (default 1000)"), cl::init(1000));
+static cl::opt<bool> EmitObject("c", cl::desc("Write a native object file instead of printing IR"));
+static cl::opt<string> OutputFilename("o", cl::desc("Output object (with -c and one input) or executable"), cl::value_desc("filename"));
+static cl::opt<string> MArch("march", cl::desc("Target CPU to generate code for, 'native' for the host CPU (default generic, native with --run)"), cl::value_desc("cpu"));
+static cl::opt<string> MAttr("mattr", cl::desc("Target features to enable or disable, e.g. +avx2,-fma"), cl::value_desc("features"));
+static cl::opt<unsigned> Jobs("j", cl::desc("Threads for code generation and object emission, used for programs of more than 32 functions (default: one per core)"), cl::Prefix, cl::init(0));
+static cl::opt<bool> UseCache("cache", cl::desc("Reuse outputs of earlier compilations of the same sources and options"));
+static cl::opt<string> CacheDir("cache-dir", cl::desc("Directory of the compilation cache, implies --cache (default: the user cache directory)"), cl::value_desc("dir"));
+static cl::opt<unsigned> CacheSize("cache-size", cl::desc("Size limit of the compilation cache, in MB (default 512)"), cl::init(512));
+static cl::opt<bool> Checked("checked", cl::desc("Trap on array indices out of range, leaving out checks that can't fail"));
+static cl::opt<bool, true> TraceCodegenOpt("trace-codegen", cl::desc("Print per-kind counts of generated AST nodes (and every node in TRACE=1 builds)"), cl::location(TraceCodegen));
+static cl::opt<bool, true> TimeReportOpt("time-report", cl::desc("Report wall and CPU time spent in each compiler phase"), cl::location(TimeReport));
+
+/* Errors of the sources end the driver, printed as they are */
+static ExitOnError ExitOnErr;
+
+int main(int argc, char **argv) {
+	cl::ParseCommandLineOptions(argc, argv, "compiler for a language like R\n");
+	if(OptLevel > 3) {
+		cerr << "Invalid optimization level: -O" << OptLevel << endl;
+		return 1;
+	}
+
+	string cpu = MArch;
+	if(cpu.empty() and (RunJIT or Interpret))
+		cpu = "native";
+	unsigned opt_level = OptLevel;
+	if(Interpret and !OptLevel.getNumOccurrences())
+		opt_level = 2;
+	unsigned jobs = Jobs ? Jobs.getValue() : max(thread::hardware_concurrency(), 1u);
+
+	vector<string> inputs(InputFilenames.begin(), InputFilenames.end());
+	if(inputs.empty())
+		inputs.push_back("-");
+	if(EmitObject and inputs.size() > 1 and !OutputFilename.empty()) {
+		cerr << "-o can't be used with -c and several input files" << endl;
+		return 1;
+	}
+
+	/* All files are parsed by the first compile, so functions can call into any of them */
+	Compiler compiler(opt_level, cpu, MAttr, jobs, Checked);
+	for(auto &input: inputs)
+		ExitOnErr(compiler.addFile(input));
+
+	/* Functions are cached on their own as well, so edited sources only
+	   generate the functions that changed */
+	unique_ptr<CompileCache> cache;
+	if(UseCache or !CacheDir.empty()) {
+		cache = ExitOnErr(CompileCache::create(CacheDir.empty() ? DefaultCacheDirectory() : CacheDir.getValue(),
+						       (uint64_t)CacheSize << 20));
+		compiler.enableIncremental(cache.get());
+	}
+
+	int ret = 0;
+	if(Interpret)
+		ret = ExitOnErr(compiler.interpret(HotThreshold));
+	else if(EmitObject and inputs.size() > 1) {
+		/* -c with several files writes one object per file */
+		for(unsigned i = 0; i < inputs.size(); i++) {
+			ExitOnErr(compiler.compileSource(i));
+			ExitOnErr(compiler.emitObject(ObjectFilename(inputs[i])));
+		}
+		if(AreStatisticsEnabled() or TraceCodegen)
+			PrintNodeCounts();
+	}
+	else if(cache) {
+		/* The whole output is cached, a hit skips parsing and code generation */
+		bool object = RunJIT or EmitObject or !OutputFilename.empty();
+		string key = compiler.cacheKey(object ? "object" : "ir");
+		unique_ptr<MemoryBuffer> output = cache->lookup(key);
+		if(!output) {
+			Module *M = ExitOnErr(compiler.compile());
+			if(AreStatisticsEnabled())
+				PrintStats(M);
+			else if(TraceCodegen)
+				PrintNodeCounts();
+			output = object ? ExitOnErr(compiler.objectBuffer()) : compiler.irBuffer();
+			cache->store(key, output->getBuffer());
+		}
+
+		if(RunJIT)
+			ret = ExitOnErr(compiler.runObject(move(output)));
+		else if(EmitObject) {
+			string filename = OutputFilename.empty() ? string("a.o") : OutputFilename.getValue();
+			error_code EC;
+			raw_fd_ostream dest(filename, EC, sys::fs::OF_None);
+			if(EC) {
+				cerr << "Could not open file: " << EC.message() << endl;
+				return 1;
+			}
+			dest << output->getBuffer();
+		}
+		else if(!OutputFilename.empty())
+			ExitOnErr(compiler.linkObject(output->getMemBufferRef(), OutputFilename));
+		else
+			outs() << output->getBuffer();
+	}
+	else {
+		Module *M = ExitOnErr(compiler.compile());
+
+		/* --stats is LLVM's own option, it also turns on our statistics */
+		if(AreStatisticsEnabled())
+			PrintStats(M);
+		else if(TraceCodegen)
+			PrintNodeCounts();
+
+		if(RunJIT)
+			ret = ExitOnErr(compiler.run());
+		else if(EmitObject)
+			ExitOnErr(compiler.emitObject(OutputFilename.empty() ? string("a.o") : OutputFilename.getValue()));
+		else if(!OutputFilename.empty())
+			ExitOnErr(compiler.emitExecutable(OutputFilename));
+		else
+			compiler.printIR(llvm::outs());
+	}
+
+	if(TimeReport)
+		PrintTimeReport();
+	if(TimeReport or AreStatisticsEnabled())
+		PrintPeakMemory();
+
+	return ret;
+}
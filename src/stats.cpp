@@ -0,0 +1,95 @@
+#include "stats.hpp"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/Timer.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+bool TimeReport;
+
+static TimerGroup PhaseTimers("r", "Compiler phases");
+static Timer Timers[] = {
+    {"parse", "Lexing and parsing", PhaseTimers},
+    {"codegen", "Code generation", PhaseTimers},
+    {"verify", "Verification", PhaseTimers},
+    {"optimize-function", "Function optimization", PhaseTimers},
+    {"optimize-module", "Module optimization", PhaseTimers},
+    {"emit", "IR printing, object emission or JIT compilation", PhaseTimers},
+    {"link", "Linking", PhaseTimers}
+};
+static thread_local vector<phase> ActivePhases;
+
+/* LLVM timers aren't thread safe, only the main thread times its phases;
+   work done by -j workers is reported as part of the enclosing phase */
+static const thread::id TimingThread = this_thread::get_id();
+
+PhaseTimer::PhaseTimer(phase p)
+    : phase_(p), active_(TimeReport and this_thread::get_id() == TimingThread)
+{
+    if(!active_)
+        return;
+    if(ActivePhases.empty() or ActivePhases.back() != p) {
+        if(!ActivePhases.empty())
+            Timers[(unsigned)ActivePhases.back()].stopTimer();
+        Timers[(unsigned)p].startTimer();
+    }
+    ActivePhases.push_back(p);
+}
+
+PhaseTimer::~PhaseTimer() {
+    if(!active_)
+        return;
+    ActivePhases.pop_back();
+    if(ActivePhases.empty() or ActivePhases.back() != phase_) {
+        Timers[(unsigned)phase_].stopTimer();
+        if(!ActivePhases.empty())
+            Timers[(unsigned)ActivePhases.back()].startTimer();
+    }
+}
+
+/* Size of a function right after codegen, before any optimization */
+struct FunctionStats {
+    string name;
+    unsigned blocks;
+    unsigned instructions;
+};
+static vector<FunctionStats> GeneratedFunctions;
+static mutex GeneratedFunctionsMutex;
+
+void RecordFunctionStats(Function *f) {
+    if(!AreStatisticsEnabled())
+        return;
+    lock_guard<mutex> lock(GeneratedFunctionsMutex);
+    GeneratedFunctions.push_back({f->getName().str(), (unsigned)f->size(), f->getInstructionCount()});
+}
+
+/* -j workers record their functions in any order, print them by name */
+void PrintStats(Module *M) {
+    PrintNodeCounts();
+    std::sort(GeneratedFunctions.begin(), GeneratedFunctions.end(), [](const FunctionStats &a, const FunctionStats &b) {
+        return a.name < b.name;
+    });
+    clog << "Functions (blocks/instructions before -> after optimization):\n";
+    for(auto &fs: GeneratedFunctions) {
+        clog << "  " << fs.name << ": " << fs.blocks << "/" << fs.instructions << " -> ";
+        Function *f = M->getFunction(fs.name);
+        if(f and !f->empty())
+            clog << f->size() << "/" << f->getInstructionCount() << '\n';
+        else
+            clog << "removed\n";
+    }
+    clog.flush();
+}
+
+void PrintTimeReport() {
+    PhaseTimers.print(errs());
+    for(auto &t: Timers)
+        t.clear();
+}
+
+void PrintPeakMemory() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    clog << "Peak memory: " << usage.ru_maxrss << " KB" << endl;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ast.hpp"
+
+/* Compiler phases measured by --time-report */
+enum class phase {
+	parse,
+	codegen,
+	verify,
+	optimize_function,
+	optimize_module,
+	emit,
+	link
+};
+
+extern bool TimeReport;
+
+/* Times a phase while the object lives; a nested phase pauses the
+   enclosing one, so every phase is reported without its children */
+class PhaseTimer {
+public:
+	PhaseTimer(phase p);
+	~PhaseTimer();
+private:
+	phase phase_;
+	bool active_;
+};
+
+void RecordFunctionStats(Function *f);
+void PrintStats(Module *M);
+void PrintTimeReport();
+void PrintPeakMemory();
@@ -0,0 +1,212 @@
+#include "ast.hpp"
+
+extern thread_local Module* TheModule;
+extern thread_local unique_ptr<LLVMContext> TheContext;
+extern thread_local const ProgramNode *TheProgram;
+
+/* Every variable gets one type per function, the widest of the values
+   assigned to it anywhere in the body, so it needs a single alloca which
+   mem2reg can turn into SSA registers */
+
+thread_local map<Function*, TypeEnv> VariableTypes;
+
+my_type MergeTypes(my_type a, my_type b) {
+    return a < b ? b : a;
+}
+
+bool IsArrayType(my_type t) {
+    return t >= my_type::int_array;
+}
+
+my_type ArrayElementType(my_type t) {
+    if(!IsArrayType(t))
+        return t;
+    return (my_type)((int)t - (int)my_type::int_array);
+}
+
+my_type ArrayOf(my_type t) {
+    if(IsArrayType(t))
+        return t;
+    return (my_type)((int)t + (int)my_type::int_array);
+}
+
+/* i1 comparison results count as ints */
+my_type TypeOf(Type *t) {
+    t = t->getScalarType();
+    if(t->isDoubleTy())
+        return my_type::double_;
+    if(t->isFloatTy())
+        return my_type::float_;
+    if(t->isIntegerTy(64))
+        return my_type::long_;
+    return my_type::int_;
+}
+
+/* LLVM type of a scalar, or of the elements of an array */
+Type *ScalarType(my_type t) {
+    switch(ArrayElementType(t)) {
+        case my_type::long_:
+            return Type::getInt64Ty(*TheContext);
+        case my_type::float_:
+            return Type::getFloatTy(*TheContext);
+        case my_type::double_:
+            return Type::getDoubleTy(*TheContext);
+        default:
+            return Type::getInt32Ty(*TheContext);
+    }
+}
+
+/* Runs inferTypes over the body until no variable changes its type */
+TypeEnv InferTypes(const ExpressionNode *body, TypeEnv env) {
+    TypeEnv previous;
+    do {
+        previous = env;
+        body->inferTypes(env);
+    } while(env != previous);
+    return env;
+}
+
+void InferVariableTypes(Function *f, const ExpressionNode *body, TypeEnv env) {
+    VariableTypes[f] = InferTypes(body, move(env));
+}
+
+static void AssignType(TypeEnv& env, symbol id, my_type t) {
+    auto it = env.find(id);
+    env[id] = it == env.end() ? t : MergeTypes(it->second, t);
+}
+
+my_type VariableNode::type(const TypeEnv& env) const {
+    auto it = env.find(id_);
+    return it == env.end() ? my_type::int_ : it->second;
+}
+
+my_type IntNode::type(const TypeEnv& env) const {
+    return isLong() ? my_type::long_ : my_type::int_;
+}
+
+my_type DoubleNode::type(const TypeEnv& env) const {
+    return my_type::double_;
+}
+
+my_type AssignmentNode::type(const TypeEnv& env) const {
+    return e_->type(env);
+}
+
+void AssignmentNode::inferTypes(TypeEnv& env) const {
+    AssignType(env, id_, e_->type(env));
+}
+
+void ArrayAssignmentNode::inferTypes(TypeEnv& env) const {
+    my_type t = my_type::int_;
+    for(auto &e: ve_)
+        t = MergeTypes(t, ArrayElementType(e->type(env)));
+    AssignType(env, id_, ArrayOf(t));
+}
+
+my_type AccessArrayNode::type(const TypeEnv& env) const {
+    auto it = env.find(id_);
+    return it == env.end() ? my_type::int_ : ArrayElementType(it->second);
+}
+
+my_type ModifyArrayNode::type(const TypeEnv& env) const {
+    auto it = env.find(id_);
+    return it == env.end() ? my_type::int_ : ArrayElementType(it->second);
+}
+
+my_type BinaryOperatorNode::type(const TypeEnv& env) const {
+    switch(op_) {
+        case bin_op::plus:
+        case bin_op::minus:
+        case bin_op::mul:
+        case bin_op::di: {
+            my_type l = l_->type(env), r = r_->type(env);
+            my_type t = MergeTypes(ArrayElementType(l), ArrayElementType(r));
+            return IsArrayType(l) or IsArrayType(r) ? ArrayOf(t) : t;
+        }
+        default:
+            return my_type::int_;
+    }
+}
+
+my_type ReturnNode::type(const TypeEnv& env) const {
+    return e_->type(env);
+}
+
+void ReturnNode::inferTypes(TypeEnv& env) const {
+    e_->inferTypes(env);
+}
+
+my_type BlockNode::type(const TypeEnv& env) const {
+    return statements_.back()->type(env);
+}
+
+void BlockNode::inferTypes(TypeEnv& env) const {
+    for(auto &s: statements_)
+        s->inferTypes(env);
+}
+
+my_type PrintNode::type(const TypeEnv& env) const {
+    return e_->type(env);
+}
+
+my_type FunctionCallNode::type(const TypeEnv& env) const {
+    const FunctionNode* f = TheProgram ? TheProgram->lookup(id_) : nullptr;
+    return f ? f->getPrototype().getReturnType() : my_type::int_;
+}
+
+/* Sequences are doubles as in R, floats when the widest argument is a
+   float */
+my_type SequenceNode::sequenceType(const TypeEnv& env) const {
+    my_type t = MergeTypes(MergeTypes(start_->type(env), end_->type(env)), step_->type(env));
+    return t == my_type::float_ ? my_type::float_array : my_type::double_array;
+}
+
+void SequenceNode::inferTypes(TypeEnv& env) const {
+    AssignType(env, id_, sequenceType(env));
+}
+
+my_type ReductionNode::type(const TypeEnv& env) const {
+    if(op_ == red_op::mean)
+        return my_type::double_;
+    return ArrayElementType(e_->type(env));
+}
+
+my_type IfElseNode::type(const TypeEnv& env) const {
+    if(then_->alwaysReturns())
+        return else_->type(env);
+    if(else_->alwaysReturns())
+        return then_->type(env);
+    return MergeTypes(then_->type(env), else_->type(env));
+}
+
+void IfElseNode::inferTypes(TypeEnv& env) const {
+    then_->inferTypes(env);
+    else_->inferTypes(env);
+}
+
+/* The counter stays an integer whatever the bounds are: a long when one
+   of them is a long, an int otherwise */
+my_type ForLoopNode::counterType(const TypeEnv& env) const {
+    if(start_->type(env) == my_type::long_ or end_->type(env) == my_type::long_)
+        return my_type::long_;
+    return my_type::int_;
+}
+
+/* The loop variable is a variable of its own inside the body */
+void ForLoopNode::inferTypes(TypeEnv& env) const {
+    auto it = env.find(id_);
+    bool shadows = it != env.end();
+    my_type old = shadows ? it->second : my_type::int_;
+
+    env[id_] = counterType(env);
+    body_->inferTypes(env);
+
+    if(shadows)
+        env[id_] = old;
+    else
+        env.erase(id_);
+}
+
+void WhileNode::inferTypes(TypeEnv& env) const {
+    body_->inferTypes(env);
+}